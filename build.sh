@@ -5,6 +5,8 @@ cython --cplus parallelSort.pyx
 g++  -g -march=native -Ofast -fpic -c    parallelSort.cpp -o parallelSort.o -fopenmp -I$(python -c "import numpy as np; print(np.get_include())") -I"$(find $(dirname $(dirname $(which conda)))/include -maxdepth 1 -iname 'python*' )"
 g++  -g -march=native -Ofast -shared  -o parallelSort.so parallelSort.o  -lgomp
 
+cc -std=c99 -O3 -g -fPIC -shared -march=native coloring_native.c -o coloring_native.so
+
 # https://stackoverflow.com/a/35317443/1779853
 pushd usort/usort
 cc -DBUILDING_u8_sort -D__BYTE_ORDER=__LITTLE_ENDIAN -DBUILDING_u4_sort -I/usr/include -I./ -I../ -I../../ -std=c99 -fgnu89-inline -O3 -g -fPIC -shared -march=native u8_sort.c -o u8_sort.so
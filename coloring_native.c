@@ -0,0 +1,277 @@
+/* Native helpers for the edge set and coloring code.
+ *
+ * Everything here is called from numba through cffi (see create_edgeset.py
+ * and utils_graph_coloring.py), and numba can't do pointer arithmetic on
+ * buffers, so every pointer argument comes with an element offset.
+ */
+
+#include <stdint.h>
+#include <immintrin.h>
+
+/* shared work queue: returns the task id at head[offset] and advances it */
+unsigned long long task_queue_pop(
+    unsigned long long *head, const unsigned long long offset) {
+  return __atomic_fetch_add(head + offset, 1ULL, __ATOMIC_RELAXED);
+}
+
+/* out[k] = hi | lo[k] for k < n. The aligned middle of the run goes out
+ * through non-temporal stores rather than pulling the destination lines
+ * into cache first. The sort does read the task back right after, but
+ * fill plus sort measured no slower this way even for tasks that fit in
+ * L2, since the sort dominates and the fill is much faster. */
+static inline void pairs_fill(
+    unsigned long long *out, const unsigned long long hi,
+    const int *lo, const long long n) {
+  long long k = 0;
+#if defined(__AVX512F__)
+  const __m512i h = _mm512_set1_epi64((long long) hi);
+  for (; k < n && ((uintptr_t) (out + k) & 63); k++)
+    out[k] = hi | (unsigned) lo[k];
+  for (; k + 8 <= n; k += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (lo + k));
+    _mm512_stream_si512((void *) (out + k),
+                        _mm512_or_si512(h, _mm512_cvtepu32_epi64(v)));
+  }
+#elif defined(__AVX2__)
+  const __m256i h = _mm256_set1_epi64x((long long) hi);
+  for (; k < n && ((uintptr_t) (out + k) & 31); k++)
+    out[k] = hi | (unsigned) lo[k];
+  for (; k + 4 <= n; k += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (lo + k));
+    _mm256_stream_si256((__m256i *) (out + k),
+                        _mm256_or_si256(h, _mm256_cvtepu32_epi64(v)));
+  }
+#endif
+  for (; k < n; k++)
+    out[k] = hi | (unsigned) lo[k];
+}
+
+/* Expands the sorted row indices[lo:lo+nnz] into its upper-triangular
+ * pairs (u64(indices[j]) << 32) | indices[k], j < k, starting from the
+ * pair (j, k) and stopping after count pairs or at the end of the row.
+ * Returns the number of pairs written to out[offset:]. */
+long long row_pairs(
+    unsigned long long *out, const unsigned long long offset,
+    const int *indices, const unsigned long long lo, const long long nnz,
+    long long j, long long k, const long long count) {
+  long long n, written = 0;
+  out += offset;
+  indices += lo;
+  while (written < count && j + 1 < nnz) {
+    n = nnz - k;
+    if (n > count - written)
+      n = count - written;
+    pairs_fill(out + written, (unsigned long long) indices[j] << 32,
+               indices + k, n);
+    written += n;
+    j++;
+    k = j + 1;
+  }
+#if defined(__AVX2__) || defined(__AVX512F__)
+  _mm_sfence();
+#endif
+  return written;
+}
+
+/* pairs_fill for u32 keys hi | lo[k], where hi already holds the left
+ * endpoint shifted into the upper 16 bits. */
+static inline void pairs_fill4(
+    unsigned *out, const unsigned hi, const int *lo, const long long n) {
+  long long k = 0;
+#if defined(__AVX512F__)
+  const __m512i h = _mm512_set1_epi32((int) hi);
+  for (; k < n && ((uintptr_t) (out + k) & 63); k++)
+    out[k] = hi | (unsigned) lo[k];
+  for (; k + 16 <= n; k += 16) {
+    __m512i v = _mm512_loadu_si512((const void *) (lo + k));
+    _mm512_stream_si512((void *) (out + k), _mm512_or_si512(h, v));
+  }
+#elif defined(__AVX2__)
+  const __m256i h = _mm256_set1_epi32((int) hi);
+  for (; k < n && ((uintptr_t) (out + k) & 31); k++)
+    out[k] = hi | (unsigned) lo[k];
+  for (; k + 8 <= n; k += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (lo + k));
+    _mm256_stream_si256((__m256i *) (out + k), _mm256_or_si256(h, v));
+  }
+#endif
+  for (; k < n; k++)
+    out[k] = hi | (unsigned) lo[k];
+}
+
+/* row_pairs for u32 keys (indices[j] << 16) | indices[k], which
+ * requires every index to be below 2**16. */
+long long row_pairs4(
+    unsigned *out, const unsigned long long offset,
+    const int *indices, const unsigned long long lo, const long long nnz,
+    long long j, long long k, const long long count) {
+  long long n, written = 0;
+  out += offset;
+  indices += lo;
+  while (written < count && j + 1 < nnz) {
+    n = nnz - k;
+    if (n > count - written)
+      n = count - written;
+    pairs_fill4(out + written, (unsigned) indices[j] << 16, indices + k, n);
+    written += n;
+    j++;
+    k = j + 1;
+  }
+#if defined(__AVX2__) || defined(__AVX512F__)
+  _mm_sfence();
+#endif
+  return written;
+}
+
+/* Intersection cardinalities of roaring-style containers: sorted u16
+ * arrays, and bitmaps of 1024 u64 words covering 2**16 values. */
+
+/* |a & b| for sorted arrays: 8x8 all-pairs compares per step with
+ * pcmpestrm (as in roaring's intersect_vector16), advancing whichever
+ * block has the smaller maximum, then a scalar merge for the tails. */
+long long card_array_array(
+    const unsigned short *a, const unsigned long long aoffset, const long long na,
+    const unsigned short *b, const unsigned long long boffset, const long long nb) {
+  long long i = 0, j = 0, count = 0;
+  a += aoffset;
+  b += boffset;
+#if defined(__SSE4_2__)
+  while (i + 8 <= na && j + 8 <= nb) {
+    const __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i *) (b + j));
+    const __m128i m = _mm_cmpestrm(
+        va, 8, vb, 8, _SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+    const unsigned short amax = a[i + 7], bmax = b[j + 7];
+    count += __builtin_popcount(_mm_cvtsi128_si32(m) & 0xff);
+    if (amax <= bmax)
+      i += 8;
+    if (bmax <= amax)
+      j += 8;
+  }
+#endif
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (a[i] > b[j]) {
+      j++;
+    } else {
+      count++;
+      i++;
+      j++;
+    }
+  }
+  return count;
+}
+
+long long card_array_bitmap(
+    const unsigned short *a, const unsigned long long aoffset, const long long na,
+    const unsigned long long *bm, const unsigned long long boffset) {
+  long long i, count = 0;
+  a += aoffset;
+  bm += boffset;
+  for (i = 0; i < na; i++)
+    count += (bm[a[i] >> 6] >> (a[i] & 63)) & 1;
+  return count;
+}
+
+long long card_bitmap_bitmap(
+    const unsigned long long *a, const unsigned long long aoffset,
+    const unsigned long long *b, const unsigned long long boffset) {
+  long long i, count = 0;
+  a += aoffset;
+  b += boffset;
+  for (i = 0; i < 1024; i++)
+    count += __builtin_popcountll(a[i] & b[i]);
+  return count;
+}
+
+/* Target encoding gathers: out[r, k] = means[offsets[k] + x[r, k] - 1] for
+ * the nrows x ncols row-major blocks at x + xoffset and out + ooffset.
+ * The output is only written, so vectors whose destination is aligned go
+ * out through non-temporal stores. Slots must be below 2**31. */
+void target_encode_rows_f64(
+    const unsigned *x, const unsigned long long xoffset,
+    const unsigned *offsets, const double *means,
+    double *out, const unsigned long long ooffset,
+    const long long nrows, const long long ncols) {
+  long long r, k;
+  x += xoffset;
+  out += ooffset;
+  for (r = 0; r < nrows; r++, x += ncols, out += ncols) {
+    k = 0;
+#if defined(__AVX512F__)
+    for (; k + 8 <= ncols; k += 8) {
+      const __m256i ix = _mm256_sub_epi32(
+          _mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (x + k)),
+                           _mm256_loadu_si256((const __m256i *) (offsets + k))),
+          _mm256_set1_epi32(1));
+      const __m512d v = _mm512_i32gather_pd(ix, means, 8);
+      if (((uintptr_t) (out + k) & 63) == 0)
+        _mm512_stream_pd(out + k, v);
+      else
+        _mm512_storeu_pd(out + k, v);
+    }
+#elif defined(__AVX2__)
+    for (; k + 4 <= ncols; k += 4) {
+      const __m128i ix = _mm_sub_epi32(
+          _mm_add_epi32(_mm_loadu_si128((const __m128i *) (x + k)),
+                        _mm_loadu_si128((const __m128i *) (offsets + k))),
+          _mm_set1_epi32(1));
+      const __m256d v = _mm256_i32gather_pd(means, ix, 8);
+      if (((uintptr_t) (out + k) & 31) == 0)
+        _mm256_stream_pd(out + k, v);
+      else
+        _mm256_storeu_pd(out + k, v);
+    }
+#endif
+    for (; k < ncols; k++)
+      out[k] = means[offsets[k] + x[k] - 1];
+  }
+#if defined(__AVX2__) || defined(__AVX512F__)
+  _mm_sfence();
+#endif
+}
+
+/* target_encode_rows_f64 narrowing the means to float32 */
+void target_encode_rows_f32(
+    const unsigned *x, const unsigned long long xoffset,
+    const unsigned *offsets, const double *means,
+    float *out, const unsigned long long ooffset,
+    const long long nrows, const long long ncols) {
+  long long r, k;
+  x += xoffset;
+  out += ooffset;
+  for (r = 0; r < nrows; r++, x += ncols, out += ncols) {
+    k = 0;
+#if defined(__AVX512F__)
+    for (; k + 8 <= ncols; k += 8) {
+      const __m256i ix = _mm256_sub_epi32(
+          _mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (x + k)),
+                           _mm256_loadu_si256((const __m256i *) (offsets + k))),
+          _mm256_set1_epi32(1));
+      const __m256 v = _mm512_cvtpd_ps(_mm512_i32gather_pd(ix, means, 8));
+      if (((uintptr_t) (out + k) & 31) == 0)
+        _mm256_stream_ps(out + k, v);
+      else
+        _mm256_storeu_ps(out + k, v);
+    }
+#elif defined(__AVX2__)
+    for (; k + 4 <= ncols; k += 4) {
+      const __m128i ix = _mm_sub_epi32(
+          _mm_add_epi32(_mm_loadu_si128((const __m128i *) (x + k)),
+                        _mm_loadu_si128((const __m128i *) (offsets + k))),
+          _mm_set1_epi32(1));
+      const __m128 v = _mm256_cvtpd_ps(_mm256_i32gather_pd(means, ix, 8));
+      if (((uintptr_t) (out + k) & 15) == 0)
+        _mm_stream_ps(out + k, v);
+      else
+        _mm_storeu_ps(out + k, v);
+    }
+#endif
+    for (; k < ncols; k++)
+      out[k] = (float) means[offsets[k] + x[k] - 1];
+  }
+#if defined(__AVX2__) || defined(__AVX512F__)
+  _mm_sfence();
+#endif
+}
@@ -1,7 +1,9 @@
 # Below code assumes that ./build.sh has been run
 import os
-from numba import jit, int32, uint32, uint64, void, float64, boolean
+from numba import jit, int32, int64, uint32, uint64, void, float64, boolean
+from numba.types import UniTuple
 import numpy as np
+import scipy.sparse as sps
 
 # https://stackoverflow.com/a/35317443/1779853
 from cffi import FFI
@@ -21,6 +23,15 @@ ffi2.cdef('void u4_sort_offset(unsigned *a, const unsigned long long offset, con
 C = ffi2.dlopen('u4_sort.so')
 C_u4_sort_offset = C.u4_sort_offset
 
+ffi3 = FFI()
+ffi3.cdef('unsigned long long task_queue_pop(unsigned long long *head, const unsigned long long offset);')
+ffi3.cdef('long long row_pairs(unsigned long long *out, const unsigned long long offset, const int *indices, const unsigned long long lo, const long long nnz, long long j, long long k, const long long count);')
+ffi3.cdef('long long row_pairs4(unsigned *out, const unsigned long long offset, const int *indices, const unsigned long long lo, const long long nnz, long long j, long long k, const long long count);')
+C = ffi3.dlopen('coloring_native.so')
+C_task_queue_pop = C.task_queue_pop
+C_row_pairs = C.row_pairs
+C_row_pairs4 = C.row_pairs4
+
 class NullContextManager(object):
     def __init__(self, total=None):
         self.dummy_resource = total
@@ -38,6 +49,20 @@ def uniquify(x):
             ctr += 1
     return min(ctr, len(x))
 
+# like uniquify, but counts[i] holds the multiplicity of x[i], and the
+# multiplicities of each run of equal x are summed into the unique entry
+@jit([uint32(uint64[:], uint32[:]), uint32(uint32[:], uint32[:])], nopython=True)
+def uniquify_counts(x, counts):
+    ctr = 0
+    for i in range(1, len(x)):
+        if x[i] != x[ctr]:
+            ctr += 1
+            x[ctr] = x[i]
+            counts[ctr] = counts[i]
+        else:
+            counts[ctr] += counts[i]
+    return min(ctr + 1, len(x))
+
 @jit(void(uint32[::1], uint64, int32), nopython=True)
 def sort4(x, offset, buflen):
     C_u4_sort_offset(ffi2.from_buffer(x), offset, buflen)
@@ -47,41 +72,183 @@ def dirty_unique(x, offset, buflen):
     C_u8_sort_offset(ffi.from_buffer(x), offset, buflen)
     return uniquify(x[offset:offset+buflen])
 
+# dirty_unique which also writes each unique value's number of
+# occurrences to the same position in counts
+@jit(uint32(uint64[::1], uint32[::1], uint64, int32), nopython=True)
+def dirty_unique_counts(x, counts, offset, buflen):
+    C_u8_sort_offset(ffi.from_buffer(x), offset, buflen)
+    counts[offset:offset+buflen] = 1
+    return uniquify_counts(x[offset:offset+buflen], counts[offset:offset+buflen])
+
+@jit(uint32(uint32[::1], uint64, int32), nopython=True)
+def dirty_unique4(x, offset, buflen):
+    C_u4_sort_offset(ffi2.from_buffer(x), offset, buflen)
+    return uniquify(x[offset:offset+buflen])
+
+@jit(uint32(uint32[::1], uint32[::1], uint64, int32), nopython=True)
+def dirty_unique_counts4(x, counts, offset, buflen):
+    C_u4_sort_offset(ffi2.from_buffer(x), offset, buflen)
+    counts[offset:offset+buflen] = 1
+    return uniquify_counts(x[offset:offset+buflen], counts[offset:offset+buflen])
+
 # https://stackoverflow.com/a/28663374/1779853
-from parallelSort import numpyParallelSort
+from parallelSort import numpyParallelSort, numpyParallelSortPairs
 
 def merge(c):
     numpyParallelSort(c)
     lenc = uniquify(c)
     return c[:lenc]
 
-# edgestores is really a matrix of row length 'rowlen'
-# but numba static analysis buckles on matrix inputs
+def merge_counts(c, counts):
+    numpyParallelSortPairs(c, counts)
+    lenc = uniquify_counts(c, counts)
+    return c[:lenc], counts[:lenc]
+
+@jit(uint64(uint64[::1]), nopython=True)
+def pop_task(head):
+    return C_task_queue_pop(ffi3.from_buffer(head), 0)
+
+@jit(uint32(uint64[:], uint64), nopython=True)
+def row_of_pair(edges_so_far, p):
+    # binary search for the row i with
+    # edges_so_far[i] <= p < edges_so_far[i + 1]
+    lo, hi = 0, len(edges_so_far) - 1
+    while hi - lo > 1:
+        mid = (lo + hi) // 2
+        if edges_so_far[mid] <= p:
+            lo = mid
+        else:
+            hi = mid
+    return lo
+
+# pairs are numbered globally in row order, then by (j, k) within
+# each row, with edges_so_far[i] the number of the first pair in row i.
+# returns (i, j, k) for pair p.
+@jit(UniTuple(int64, 3)(int32[:], uint64[:], uint64), nopython=True)
+def pair_position(indptr, edges_so_far, p):
+    i = row_of_pair(edges_so_far, p)
+    q = int64(p - edges_so_far[i])
+    nnz = indptr[i + 1] - indptr[i]
+    j = 0
+    while q >= nnz - j - 1:
+        q -= nnz - j - 1
+        j += 1
+    return i, j, j + 1 + q
+
+# writes pairs [p_lo, p_hi) to edgestores[pos:], which might start
+# or stop anywhere in the middle of a row.
+@jit(
+    void(uint64[::1], int64, int32[:], int32[::1], uint64[:], uint64, uint64),
+    nopython=True
+)
+def pairs_range(edgestores, pos, indptr, indices, edges_so_far, p_lo, p_hi):
+    count = int64(p_hi - p_lo)
+    i, j, k = pair_position(indptr, edges_so_far, p_lo)
+    lo, nnz = indptr[i], indptr[i + 1] - indptr[i]
+
+    out = ffi3.from_buffer(edgestores)
+    ixs = ffi3.from_buffer(indices)
+    while True:
+        # we assume int32s are positive all over
+        written = C_row_pairs(out, pos, ixs, lo, nnz, j, k, count)
+        pos += written
+        count -= written
+        if count == 0:
+            break
+        # row exhausted, so the next pair is in a later row
+        i += 1
+        lo, nnz = indptr[i], indptr[i + 1] - indptr[i]
+        j, k = 0, 1
+
+# pairs_range for u32 keys (left << 16) | right
 @jit(
-    void(uint64[::1], uint32, int32[:], int32[:], uint32[:], uint32[:], uint32[:]),
+    void(uint32[::1], int64, int32[:], int32[::1], uint64[:], uint64, uint64),
+    nopython=True
+)
+def pairs_range4(edgestores, pos, indptr, indices, edges_so_far, p_lo, p_hi):
+    count = int64(p_hi - p_lo)
+    i, j, k = pair_position(indptr, edges_so_far, p_lo)
+    lo, nnz = indptr[i], indptr[i + 1] - indptr[i]
+
+    out = ffi3.from_buffer(edgestores)
+    ixs = ffi3.from_buffer(indices)
+    while True:
+        written = C_row_pairs4(out, pos, ixs, lo, nnz, j, k, count)
+        pos += written
+        count -= written
+        if count == 0:
+            break
+        i += 1
+        lo, nnz = indptr[i], indptr[i + 1] - indptr[i]
+        j, k = 0, 1
+
+# pairs [batch_lo, batch_hi) are cut into tasks of task_size pairs each,
+# and task t is written to edgestores[t * task_size:]. Each of the nworkers
+# threads pops tasks off the shared queue at head[0] until there are none
+# left, so a heavy row just becomes several tasks and one slow task
+# doesn't hold up the other threads.
+#
+# with with_counts, countstores (laid out like edgestores) gets the
+# number of rows each of the task's unique pairs came from.
+@jit(
+    void(uint64[::1], uint32[::1], boolean, int32[:], int32[::1], uint64[:],
+         uint64, uint64, uint64, uint64[::1], uint32, uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def pairs_into(edgestores, countstores, with_counts, indptr, indices, edges_so_far,
+               batch_lo, batch_hi, task_size, head, nworkers, out):
+    ntasks = len(out)
+    for _ in prange(nworkers):
+        while True:
+            t = pop_task(head)
+            if t >= ntasks:
+                break
+            p_lo = batch_lo + t * task_size
+            p_hi = min(p_lo + task_size, batch_hi)
+            offset = t * task_size
+            pairs_range(edgestores, offset, indptr, indices, edges_so_far, p_lo, p_hi)
+            if with_counts:
+                out[t] = dirty_unique_counts(edgestores, countstores, offset, p_hi - p_lo)
+            else:
+                out[t] = dirty_unique(edgestores, offset, p_hi - p_lo)
+
+# pairs_into for u32 keys
+@jit(
+    void(uint32[::1], uint32[::1], boolean, int32[:], int32[::1], uint64[:],
+         uint64, uint64, uint64, uint64[::1], uint32, uint32[:]),
     nopython=True,
     parallel=True
 )
-def pairs_into(edgestores, rowlen, indptr, indices, starts, stops, out):
-    SKIP = rowlen
-    nthreads = len(starts)
-    for t in prange(nthreads):
-        ctr = 0
-        for i in range(starts[t], stops[t]):
-            lo, hi = indptr[i], indptr[i+1]
-            nnz = hi - lo
-            for j, d in enumerate(indices[lo:hi]):
-                nk = nnz - j - 1
-                # we assume int32s are positive all over
-                edgestores[t * SKIP + ctr:t * SKIP + ctr + nk] = uint64(d) << 32
-                for k in range(nk):
-                    edgestores[t * SKIP + ctr + k] |= uint64(indices[lo + j + k + 1])
-                ctr += nk
-        uq = dirty_unique(edgestores, t * SKIP, ctr)
-        out[t] = uq
-
-def create_edgeset_u64(Xbinary_csr, edgebufsz, tqdm=None, nthreads=16):
+def pairs_into4(edgestores, countstores, with_counts, indptr, indices, edges_so_far,
+                batch_lo, batch_hi, task_size, head, nworkers, out):
+    ntasks = len(out)
+    for _ in prange(nworkers):
+        while True:
+            t = pop_task(head)
+            if t >= ntasks:
+                break
+            p_lo = batch_lo + t * task_size
+            p_hi = min(p_lo + task_size, batch_hi)
+            offset = t * task_size
+            pairs_range4(edgestores, offset, indptr, indices, edges_so_far, p_lo, p_hi)
+            if with_counts:
+                out[t] = dirty_unique_counts4(edgestores, countstores, offset, p_hi - p_lo)
+            else:
+                out[t] = dirty_unique4(edgestores, offset, p_hi - p_lo)
+
+def create_edgeset_u64(Xbinary_csr, edgebufsz, tqdm=None, nthreads=16, tasks_per_thread=8, counts=False):
     """
+    Returns the sorted, unique co-occurring column pairs of Xbinary_csr,
+    packed as (u64(left) << 32) | right with left < right.
+
+    If counts, returns (edges, edge_counts) instead, where edge_counts
+    is a parallel u32 array with the number of rows containing each pair.
+
+    Each pass over the rows fills nthreads * edgebufsz pairs, split into
+    tasks of edgebufsz // tasks_per_thread pairs that threads pull
+    from a shared queue. Rows may be arbitrarily heavy.
+
     NOTE: this doesn't actually set the number of threads.
     You should have done that at the beginning of your program for
     OMP_NUM_THREADS
@@ -89,45 +256,248 @@ def create_edgeset_u64(Xbinary_csr, edgebufsz, tqdm=None, nthreads=16):
     NUMBA_NUM_THREADS
     These can't be re-initialized.
     """
-    nnzr = np.diff(Xbinary_csr.indptr)
-    edges_per_row = nnzr * (nnzr - 1) // 2
-    m = edges_per_row.max()
-    assert edges_per_row.max() < edgebufsz
-    edges_so_far = np.cumsum(np.insert(edges_per_row, 0, 0))
-    edges_so_far = np.insert(edges_so_far, -1, edges_so_far[-1])
+    return _create_edgeset(
+        Xbinary_csr, edgebufsz, tqdm, nthreads, tasks_per_thread, counts, np.uint64)
+
+# vertex ids below this fit into half of a u32 edge key
+u32_key_nverts = 2 ** 16
 
-    edgebuf = np.zeros(nthreads * edgebufsz, np.uint64)
+def create_edgeset(Xbinary_csr, edgebufsz, tqdm=None, nthreads=16, tasks_per_thread=8, counts=False, relabel=False):
+    """
+    create_edgeset_u64, except that when every column id of Xbinary_csr
+    is below 2**16, edges are packed into u32 keys as (left << 16) | right
+    instead, which sort in 3 radix passes instead of 8 at half the memory.
+    Check edges.dtype (or edge_shift(edges)) for the packing used.
+
+    With relabel, columns with no nonzeros are dropped and the remaining
+    ones renumbered densely in order before packing, so u32 keys are used
+    whenever at most 2**16 columns are live. Then this returns
+    (edges, vertex_ids) or (edges, edge_counts, vertex_ids), where edges
+    are over the new vertex ids and column vertex_ids[v] is vertex v.
+    """
+    if relabel:
+        vertex_ids = np.flatnonzero(np.bincount(
+            Xbinary_csr.indices, minlength=Xbinary_csr.shape[1])).astype(np.uint32)
+        new_ids = np.zeros(Xbinary_csr.shape[1], np.int32)
+        new_ids[vertex_ids] = np.arange(len(vertex_ids), dtype=np.int32)
+        Xbinary_csr = sps.csr_matrix(
+            (Xbinary_csr.data, new_ids[Xbinary_csr.indices], Xbinary_csr.indptr),
+            shape=(Xbinary_csr.shape[0], len(vertex_ids)))
 
-    parent = np.zeros((0,), np.uint64)
+    key_dtype = np.uint32 if Xbinary_csr.shape[1] <= u32_key_nverts else np.uint64
+    result = _create_edgeset(
+        Xbinary_csr, edgebufsz, tqdm, nthreads, tasks_per_thread, counts, key_dtype)
 
+    if relabel:
+        return (result if counts else (result,)) + (vertex_ids,)
+    return result
+
+def edge_shift(edges):
+    """
+    Bits in the right endpoint of packed edges, 32 for u64 keys
+    and 16 for u32 keys.
+    """
+    return edges.itemsize * 4
+
+def _create_edgeset(Xbinary_csr, edgebufsz, tqdm, nthreads, tasks_per_thread, counts, key_dtype):
+    nnzr = np.diff(Xbinary_csr.indptr).astype(np.int64)
+    edges_per_row = nnzr * (nnzr - 1) // 2
     nrows = Xbinary_csr.shape[0]
-    row_start = 0
+    edges_so_far = np.zeros(nrows + 1, np.uint64)
+    edges_so_far[1:] = np.cumsum(edges_per_row)
+    total = int(edges_so_far[-1])
+
+    task_size = max(1, edgebufsz // tasks_per_thread)
+    batchsz = nthreads * edgebufsz
+    edgebuf = np.zeros(batchsz, key_dtype)
+    countbuf = np.zeros(batchsz if counts else 0, np.uint32)
+    fill = pairs_into4 if key_dtype == np.uint32 else pairs_into
+
+    parent = np.zeros((0,), key_dtype)
+    parent_counts = np.zeros((0,), np.uint32)
+
+    batch_lo = 0
+    rows_done = 0
     pbar_gen = tqdm if tqdm else NullContextManager
     with pbar_gen(total=nrows) as pbar:
-        while row_start < nrows:
-            lens = np.zeros(nthreads, np.uint32)
-
-            edgebufsz_lb = edgebufsz - m
-            # assert edgebufsz_lb > 0
-            target_stop_values = (np.arange(nthreads, dtype=np.uint64) + 1) * edgebufsz_lb
-            target_stop_values += edges_so_far[row_start]
-            ixs = np.searchsorted(edges_so_far[row_start:-1], target_stop_values).astype(np.uint32)
-            row_stops = ixs.astype(np.uint32) + row_start
-            row_starts = np.roll(row_stops.copy(), 1)
-            row_starts[0] = row_start
-            # assert (edges_so_far[row_stops] - edges_so_far[row_starts]).max() <= edgebufsz
-
-            pairs_into(
-                edgebuf, edgebufsz,
+        while batch_lo < total:
+            batch_hi = min(batch_lo + batchsz, total)
+            ntasks = (batch_hi - batch_lo + task_size - 1) // task_size
+            lens = np.zeros(ntasks, np.uint32)
+            head = np.zeros(1, np.uint64)
+
+            fill(
+                edgebuf, countbuf, counts,
                 Xbinary_csr.indptr,
                 Xbinary_csr.indices,
-                row_starts, row_stops, lens)
+                edges_so_far,
+                batch_lo, batch_hi, task_size,
+                head, nthreads, lens)
 
-            cat = np.concatenate([parent] + [edgebuf[t*edgebufsz:t*edgebufsz + l] for t, l in enumerate(lens)])
-            parent = merge(cat)
+            cat = np.concatenate([parent] + [edgebuf[t*task_size:t*task_size + l] for t, l in enumerate(lens)])
+            if counts:
+                cat_counts = np.concatenate([parent_counts] + [countbuf[t*task_size:t*task_size + l] for t, l in enumerate(lens)])
+                parent, parent_counts = merge_counts(cat, cat_counts)
+            else:
+                parent = merge(cat)
 
             if tqdm:
-                pbar.update(min(row_stops[-1], nrows) - row_start)
-            row_start = row_stops[-1]
+                # rows whose last pair has been written
+                rows = int(np.searchsorted(edges_so_far[1:], batch_hi, 'right'))
+                pbar.update(rows - rows_done)
+                rows_done = rows
+            batch_lo = batch_hi
 
+    if counts:
+        return parent, parent_counts
     return parent
+
+def sample_rows(nnzr, rate, heavy_nnz=None, heavy_rate=None, seed=0):
+    """
+    Stratified row sample, returned as sorted row indices.
+
+    Rows are bucketed by floor(log2(nnz)) and each bucket keeps
+    round(rate * size) of its rows (at least one), chosen uniformly,
+    so the rare heavy rows that create most conflicts are represented
+    even at low rates. Rows with at least heavy_nnz nonzeros are
+    sampled at heavy_rate instead, if given.
+    """
+    rng = np.random.RandomState(seed)
+    nnzr = np.asarray(nnzr)
+    strata = np.zeros(len(nnzr), np.int64)
+    strata[nnzr > 0] = np.log2(nnzr[nnzr > 0]).astype(np.int64) + 1
+    rates = np.full(len(nnzr), rate, np.float64)
+    if heavy_nnz is not None:
+        # separate strata for the heavy rows
+        heavy = nnzr >= heavy_nnz
+        strata[heavy] += strata.max() + 1
+        rates[heavy] = rate if heavy_rate is None else heavy_rate
+
+    keep = []
+    for s in np.unique(strata):
+        rows = np.flatnonzero(strata == s)
+        r = rates[rows[0]]
+        k = min(len(rows), max(1, int(round(r * len(rows))))) if r > 0 else 0
+        keep.append(rng.choice(rows, k, replace=False))
+    return np.sort(np.concatenate(keep)).astype(np.int64)
+
+def create_edgeset_approx(
+        Xbinary_csr, edgebufsz, rate, tqdm=None, nthreads=16,
+        heavy_nnz=None, heavy_rate=None, min_count=1, seed=0):
+    """
+    An approximate edge set, built by create_edgeset over a
+    sample_rows sample of Xbinary_csr and keeping only the pairs
+    found in at least min_count sampled rows.
+
+    Vertex ids are the columns of Xbinary_csr (no relabeling). Colorings
+    from these edges may have conflicts on the full data; see
+    utils_graph_coloring.repair_coloring.
+    """
+    rows = sample_rows(
+        np.diff(Xbinary_csr.indptr), rate, heavy_nnz, heavy_rate, seed)
+    Xsample = Xbinary_csr[rows]
+    if min_count <= 1:
+        return create_edgeset(Xsample, edgebufsz, tqdm, nthreads)
+    edges, counts = create_edgeset(Xsample, edgebufsz, tqdm, nthreads, counts=True)
+    return edges[counts >= min_count]
+
+def widen_edges(edges):
+    """
+    Repacks u32 edges (left << 16) | right as u64 (left << 32) | right,
+    keeping them sorted; u64 edges are returned as is.
+    """
+    if edges.dtype == np.uint64:
+        return edges
+    edges = edges.astype(np.uint64)
+    return ((edges >> np.uint64(16)) << np.uint64(32)) | (edges & np.uint64(0xffff))
+
+# edges[i] = (min(a, b) << shift) | max(a, b) for the new ids a, b of
+# its endpoints
+@jit(
+    [void(uint64[:], uint32[:]), void(uint32[:], uint32[:])],
+    nopython=True,
+    parallel=True
+)
+def _relabel_edges_compiled(edges, new_ids):
+    shift = uint32(edges.itemsize * 4)
+    for i in prange(len(edges)):
+        e = edges[i]
+        a = new_ids[e >> shift]
+        b = new_ids[e - ((e >> shift) << shift)]
+        edges[i] = (uint64(min(a, b)) << shift) | uint64(max(a, b))
+
+def relabel_edges(edges, new_ids):
+    """
+    Returns the sorted packed edges with every vertex v renumbered to
+    new_ids[v], a u32 permutation of the vertices, keeping the packing.
+    """
+    edges = edges.copy()
+    _relabel_edges_compiled(edges, new_ids)
+    numpyParallelSort(edges)
+    return edges
+
+def added_edges(edges, new_edges):
+    """
+    Accepts two sorted, unique edge arrays of the same key width.
+    Returns the sorted new_edges that aren't in edges.
+    """
+    if len(edges) == 0:
+        return new_edges
+    ix = np.minimum(np.searchsorted(edges, new_edges), len(edges) - 1)
+    return new_edges[edges[ix] != new_edges]
+
+class WindowedEdgeSet:
+    """
+    The co-occurrence graph of a sliding window of days of rows over
+    nverts columns, kept up to date as days are added and expired
+    instead of being rebuilt for every window.
+
+    Each day keeps its own sorted edges and per-edge row counts, and
+    edges/support hold the union over the window, with support the
+    number of window rows containing each edge.
+    """
+
+    def __init__(self, nverts, edgebufsz, tqdm=None, nthreads=16):
+        self.nverts = nverts
+        self.edgebufsz = edgebufsz
+        self.tqdm = tqdm
+        self.nthreads = nthreads
+        self.days = {}
+        key_dtype = np.uint32 if nverts <= u32_key_nverts else np.uint64
+        self.edges = np.zeros((0,), key_dtype)
+        self.support = np.zeros((0,), np.uint32)
+
+    def add_day(self, day, Xday_csr):
+        """
+        Adds the rows of Xday_csr (over all nverts columns) as day.
+
+        Returns the sorted edges that are new to the window.
+        """
+        assert day not in self.days, day
+        assert Xday_csr.shape[1] == self.nverts, (Xday_csr.shape, self.nverts)
+        edges, counts = create_edgeset(
+            Xday_csr, self.edgebufsz, self.tqdm, self.nthreads, counts=True)
+        # both are sorted and unique, so merge linearly: bump the
+        # support of known edges and insert the rest in place
+        ix = np.searchsorted(self.edges, edges)
+        known = ix < len(self.edges)
+        known[known] = self.edges[ix[known]] == edges[known]
+        self.support[ix[known]] += counts[known]
+        fresh = edges[~known]
+        self.edges = np.insert(self.edges, ix[~known], fresh)
+        self.support = np.insert(self.support, ix[~known], counts[~known])
+        self.days[day] = (edges, counts)
+        return fresh
+
+    def expire_day(self, day):
+        """
+        Drops day from the window.
+
+        Returns the sorted edges that lost all their support.
+        """
+        edges, counts = self.days.pop(day)
+        self.support[np.searchsorted(self.edges, edges)] -= counts
+        alive = self.support > 0
+        expired = self.edges[~alive]
+        self.edges, self.support = self.edges[alive], self.support[alive]
+        return expired
@@ -27,3 +27,46 @@ cdef extern from "<parallel/algorithm>" namespace "__gnu_parallel":
 def numpyParallelSort(real[:] a):
     "In-place parallel sort for numpy types"
     sort(&a[0], &a[a.shape[0]])
+
+from libcpp.pair cimport pair
+from libc.stdint cimport uint64_t
+from libc.stdlib cimport malloc, free
+from cython.parallel import prange
+
+ctypedef fused ukey:
+    cython.uint
+    cython.ulong
+    cython.ulonglong
+
+def numpyParallelSortPairs(ukey[:] keys, cython.uint[:] values):
+    "In-place parallel sort of keys, permuting values along with them"
+    cdef Py_ssize_t i, n = keys.shape[0]
+    assert values.shape[0] == n
+    if n == 0:
+        return
+    cdef uint64_t *packed
+    cdef pair[ukey, cython.uint] *kv
+    if ukey is cython.uint:
+        # u32 keys and values sort as single u64s
+        packed = <uint64_t *> malloc(n * sizeof(uint64_t))
+        if packed == NULL:
+            raise MemoryError()
+        for i in prange(n, nogil=True):
+            packed[i] = (<uint64_t> keys[i] << 32) | values[i]
+        sort(packed, packed + n)
+        for i in prange(n, nogil=True):
+            keys[i] = <cython.uint> (packed[i] >> 32)
+            values[i] = <cython.uint> packed[i]
+        free(packed)
+    else:
+        kv = <pair[ukey, cython.uint] *> malloc(n * sizeof(pair[ukey, cython.uint]))
+        if kv == NULL:
+            raise MemoryError()
+        for i in prange(n, nogil=True):
+            kv[i].first = keys[i]
+            kv[i].second = values[i]
+        sort(kv, kv + n)
+        for i in prange(n, nogil=True):
+            keys[i] = kv[i].first
+            values[i] = kv[i].second
+        free(kv)
@@ -6,9 +6,16 @@ Here, take this:
 PYTHONMALLOC=malloc valgrind --tool=memcheck --error-limit=no python ...
 """
 
-from numba import jit, int32, uint32, uint64, void, float64, boolean, prange
+import numba
+from numba import jit, int32, int64, uint8, uint16, uint32, uint64, void, float32, float64, boolean, prange
+try:
+    from numba.cpython.unsafe.numbers import trailing_zeros
+except ImportError:
+    # older numba
+    from numba.unsafe.numbers import trailing_zeros
 import numpy as np
 import scipy.sparse as sps
+from scipy.sparse.csgraph import reverse_cuthill_mckee
 
 @jit(
     void(float64[:], int32[:], uint32[:]),
@@ -85,7 +92,87 @@ def remap_floats(X, uniques, offsets, nunique):
     constructor = sps.csc_matrix if X.getformat() else sps.csr_matrix
     return constructor((data, X.indices, X.indptr))
 
-from create_edgeset import uniquify, sort4, create_edgeset_u64 as create_edgeset_u64
+# remap_floats into at most max_bin bins per column: bin b (from 1)
+# starts at the unique value lower[b - 1], spread evenly over the
+# sorted uniques, so each unique value is its own bin if there are few
+@jit(
+    void(
+        float64[:], int32[:], uint32[:],
+        float64[:], int32[:], uint32[:], uint32),
+    nopython=True,
+    parallel=True
+)
+def _bin_floats_compiled(
+    data, indptr, data_out,
+    uniques, offsets, nuniques, max_bin):
+    for i in prange(len(indptr) - 1):
+        start, stop = indptr[i], indptr[i + 1]
+        ustart, nu = offsets[i], nuniques[i]
+        nb = min(nu, max_bin)
+        lower = np.empty(nb, np.float64)
+        for b in range(nb):
+            lower[b] = uniques[ustart + (b * nu) // nb]
+        data_out[start:stop] = np.searchsorted(lower, data[start:stop], side='right')
+
+def bin_continuous(Xcontinuous_csc, max_bin=255):
+    """
+    Accepts a sparse CSC matrix of mostly-zero continuous features
+    over float64 (see extract_sparse with continuous_format='csc').
+
+    Returns (Xbinned_csc, nbins), where Xbinned_csc holds the u32 bin
+    of each nonzero, from 1 to nbins[i] <= max_bin in column i, with
+    bins of about as many distinct values each.
+    """
+    X = Xcontinuous_csc
+    assert sps.issparse(X) and X.getformat() == 'csc', type(X)
+    uniques, offsets, nunique = get_uniques_and_counts(X)
+    data = np.empty(len(X.data), np.uint32)
+    _bin_floats_compiled(
+        X.data, X.indptr, data,
+        uniques, offsets, nunique, max_bin)
+    nbins = np.minimum(nunique, max_bin).astype(np.uint32)
+    return sps.csc_matrix((data, X.indices, X.indptr), shape=X.shape), nbins
+
+def join_binned(Xbinary_csr, Xbinned_csc, nbins):
+    """
+    Appends the binned continuous columns from bin_continuous after the
+    binary ones, as vertices of the co-occurrence graph like any other
+    column.
+
+    Returns (Xcodes_csr, vertex_nbins), where Xcodes_csr holds the u32
+    code of each nonzero (1 for binary columns, else the bin) and is
+    usable as Xbinary_csr by create_edgeset, and vertex_nbins is the
+    number of codes of each column (see bundle_remap).
+    """
+    Xcodes_csr = sps.hstack([
+        Xbinary_csr.astype(np.uint32), Xbinned_csc.tocsr()], 'csr')
+    Xcodes_csr.sort_indices()
+    Xcodes_csr.indptr = Xcodes_csr.indptr.astype(np.int32)
+    Xcodes_csr.indices = Xcodes_csr.indices.astype(np.int32)
+    vertex_nbins = np.concatenate([
+        np.ones(Xbinary_csr.shape[1], np.uint32), nbins]).astype(np.uint32)
+    return Xcodes_csr, vertex_nbins
+
+from create_edgeset import uniquify, sort4, create_edgeset_u64 as create_edgeset_u64, create_edgeset, edge_shift
+from create_edgeset import create_edgeset_approx, merge, WindowedEdgeSet, u32_key_nverts
+from create_edgeset import relabel_edges
+
+# the roaring cardinality and target encoding kernels from
+# coloring_native.c, which like create_edgeset's take element offsets
+from cffi import FFI
+
+ffi_native = FFI()
+ffi_native.cdef('long long card_array_array(const unsigned short *a, const unsigned long long aoffset, const long long na, const unsigned short *b, const unsigned long long boffset, const long long nb);')
+ffi_native.cdef('long long card_array_bitmap(const unsigned short *a, const unsigned long long aoffset, const long long na, const unsigned long long *bm, const unsigned long long boffset);')
+ffi_native.cdef('long long card_bitmap_bitmap(const unsigned long long *a, const unsigned long long aoffset, const unsigned long long *b, const unsigned long long boffset);')
+ffi_native.cdef('void target_encode_rows_f64(const unsigned *x, const unsigned long long xoffset, const unsigned *offsets, const double *means, double *out, const unsigned long long ooffset, const long long nrows, const long long ncols);')
+ffi_native.cdef('void target_encode_rows_f32(const unsigned *x, const unsigned long long xoffset, const unsigned *offsets, const double *means, float *out, const unsigned long long ooffset, const long long nrows, const long long ncols);')
+C_native = ffi_native.dlopen('coloring_native.so')
+C_card_array_array = C_native.card_array_array
+C_card_array_bitmap = C_native.card_array_bitmap
+C_card_bitmap_bitmap = C_native.card_bitmap_bitmap
+C_target_encode_rows_f64 = C_native.target_encode_rows_f64
+C_target_encode_rows_f32 = C_native.target_encode_rows_f32
 
 def onehot(Xcategorical_csc_remapped, nunique):
     # accepts CSC remapped values (contiguous ints in each column)
@@ -124,25 +211,33 @@ def onehot(Xcategorical_csc_remapped, nunique):
 
 # create an inline adjacency list
 
-@jit(uint32(uint64), nopython=True)
-def left(x):
-    return x >> 32
+# edges are packed as (left << shift) | right, where shift is 32
+# for u64 edges and 16 for u32 edges (see create_edgeset.edge_shift)
+
+@jit([uint32(uint64, uint32), uint32(uint32, uint32)], nopython=True)
+def left(x, shift):
+    return x >> shift
 
-@jit(uint32(uint64), nopython=True)
-def right(x):
-    return x & (2 ** 32 - 1)
+@jit([uint32(uint64, uint32), uint32(uint32, uint32)], nopython=True)
+def right(x, shift):
+    return x - ((x >> shift) << shift)
 
-@jit(void(uint64[:], uint32[:]), nopython=True)
+@jit([void(uint64[:], uint32[:]), void(uint32[:], uint32[:])], nopython=True)
 def count_degree(edges, degree):
-    for e64 in edges:
-        l, r = left(e64), right(e64)
+    shift = uint32(edges.itemsize * 4)
+    for e in edges:
+        l, r = left(e, shift), right(e, shift)
         degree[l] += 1
         degree[r] += 1
 
-@jit(void(uint64[:], uint32[::1], uint64[:], uint64[:]), nopython=True, parallel=True)
+@jit(
+    [void(uint64[:], uint32[::1], uint64[:], uint64[:]),
+     void(uint32[:], uint32[::1], uint64[:], uint64[:])],
+    nopython=True, parallel=True)
 def fill_edges(edges, bidir_edges, start_offsets, start_offsets_immutable):
-    for e64 in edges:
-        l, r = left(e64), right(e64)
+    shift = uint32(edges.itemsize * 4)
+    for e in edges:
+        l, r = left(e, shift), right(e, shift)
         bidir_edges[start_offsets[l]] = r
         bidir_edges[start_offsets[r]] = l
         start_offsets[l] += 1
@@ -155,53 +250,2080 @@ def fill_edges(edges, bidir_edges, start_offsets, start_offsets_immutable):
         sort4(bidir_edges, start, stop - start)
 
 u32max = np.iinfo(np.uint32).max
+u64max = np.iinfo(np.uint64).max
+
+# bit c of adjacent_colors[c >> 6] is set iff the current vertex has a
+# neighbor of color c. Only the first (ncolors >> 6) + 1 words are ever
+# set, and the array is grown so that those always exist, so the first
+# free color is the lowest zero bit of the first word that isn't all ones.
+# Vertices outside vertex_order may already be colored, with colors
+# below ncolors, which is returned updated.
 @jit(
     uint32(uint32[:], uint32[:], uint64[:],
-           uint32[:], boolean[:]),
+           uint32[:], uint32, uint32),
     nopython=True
 )
 def _color_graph_compiled(
     vertex_order, adjacency, vertex_offsets,
-    color_map, adjacent_colors):
-    ncolors = 0
+    color_map, color_ub, ncolors):
+    adjacent_colors = np.zeros(max(1, (max(color_ub, ncolors) + 64) // 64), np.uint64)
     for v in vertex_order:
+        nwords = (ncolors >> 6) + 1
+        if nwords > len(adjacent_colors):
+            # it's all clear between vertices, no need to copy
+            adjacent_colors = np.zeros(2 * len(adjacent_colors), np.uint64)
+
         vstart, vend = vertex_offsets[v], vertex_offsets[v + 1]
         for n in adjacency[vstart:vend]:
-            if color_map[n] != u32max:
-                adjacent_colors[color_map[n]] = True
+            c = color_map[n]
+            if c != u32max:
+                adjacent_colors[c >> 6] |= uint64(1) << uint64(c & 63)
 
-        color = ncolors
-        for i in range(ncolors):
-            if not adjacent_colors[i]:
-                color = i
+        w = 0
+        while adjacent_colors[w] == u64max:
+            w += 1
+        color = w * 64 + int64(trailing_zeros(~adjacent_colors[w]))
+
+        ncolors = max(color + 1, ncolors)
+        color_map[v] = color
+
+        if vend - vstart > nwords:
+            adjacent_colors[:nwords] = 0
+        else:
+            for n in adjacency[vstart:vend]:
+                c = color_map[n]
+                if c != u32max:
+                    adjacent_colors[c >> 6] = 0
+    return ncolors
+
+# color_graph_parallel rounds over the implicit co-occurrence graph:
+# the neighbors of v are the columns of the rows of column v, read
+# off Xbinary_csc and Xbinary_csr. Since a neighbor is reached once per
+# shared row, visited[u] == i + 1 skips it after the first time.
+@jit(
+    void(uint32[:], int32[:], int32[:], int32[:], int32[:],
+         uint32[:], uint32, uint32, uint32),
+    nopython=True,
+    parallel=True
+)
+def _implicit_speculative_color_compiled(
+    U, csr_indptr, csr_indices, csc_indptr, csc_indices,
+    color_map, max_degree, nlanes, block):
+    n = len(U)
+    nverts = len(color_map)
+    nblocks = (n + block - 1) // block
+    for lane in prange(nlanes):
+        forbidden = np.zeros(max_degree + 2, np.uint32)
+        visited = np.zeros(nverts, np.uint32)
+        for b in range(lane, nblocks, nlanes):
+            for i in range(b * block, min(n, (b + 1) * block)):
+                v = U[i]
+                stamp = i + 1
+                visited[v] = stamp
+                for row in csc_indices[csc_indptr[v]:csc_indptr[v + 1]]:
+                    for u in csr_indices[csr_indptr[row]:csr_indptr[row + 1]]:
+                        if visited[u] != stamp:
+                            visited[u] = stamp
+                            c = color_map[u]
+                            if c != u32max:
+                                forbidden[c] = stamp
+                color = 0
+                while forbidden[color] == stamp:
+                    color += 1
+                color_map[v] = color
+
+@jit(
+    uint64(uint32[:], int32[:], int32[:], int32[:], int32[:],
+           uint32[:], uint32[:], boolean[:]),
+    nopython=True,
+    parallel=True
+)
+def _implicit_detect_conflicts_compiled(
+    U, csr_indptr, csr_indices, csc_indptr, csc_indices,
+    color_map, rank, lost):
+    nconflicts = 0
+    for i in prange(len(U)):
+        v = U[i]
+        c = color_map[v]
+        for row in csc_indices[csc_indptr[v]:csc_indptr[v + 1]]:
+            for u in csr_indices[csr_indptr[row]:csr_indptr[row + 1]]:
+                if u != v and color_map[u] == c and rank[u] < rank[v]:
+                    lost[i] = True
+            if lost[i]:
+                nconflicts += 1
                 break
+    return nconflicts
+
+def color_implicit(Xbinary_csr, Xbinary_csc=None, nlanes=None, block=64):
+    """
+    color_graph_parallel directly on the co-occurrence graph of
+    Xbinary_csr, without building the edge set: the neighbors of v
+    are found by walking column v of Xbinary_csc to its rows, and those
+    rows in Xbinary_csr to their columns.
+
+    Needs O(nnz) memory for the two matrices, plus an nverts u32
+    visited array per lane. Vertices go largest first by
+    sum(nnz(row) - 1) over their rows, which bounds their degree.
+
+    Returns (ncolors, color_map, conflicts) as color_graph_parallel does.
+    """
+    if Xbinary_csc is None:
+        Xbinary_csc = Xbinary_csr.tocsc()
+    if nlanes is None:
+        nlanes = numba.config.NUMBA_NUM_THREADS
+    nverts = Xbinary_csr.shape[1]
+    nnzr = np.diff(Xbinary_csr.indptr)
+    degree_ub = np.bincount(
+        Xbinary_csr.indices, weights=np.repeat(np.maximum(nnzr - 1, 0), nnzr),
+        minlength=nverts)
+    max_degree = int(min(degree_ub.max(), nverts - 1)) if nverts else 0
+    largest_first = np.argsort(degree_ub, kind='stable')[::-1].astype(np.uint32)
+    rank = np.empty(nverts, np.uint32)
+    rank[largest_first] = np.arange(nverts, dtype=np.uint32)
+
+    args = (
+        Xbinary_csr.indptr, Xbinary_csr.indices,
+        Xbinary_csc.indptr, Xbinary_csc.indices)
+    color_map = np.full(int(nverts), u32max, dtype=np.uint32)
+    U = largest_first
+    conflicts = []
+    while len(U):
+        color_map[U] = u32max
+        _implicit_speculative_color_compiled(
+            U, *args, color_map, max_degree, nlanes, block)
+        lost = np.zeros(len(U), bool)
+        conflicts.append(_implicit_detect_conflicts_compiled(
+            U, *args, color_map, rank, lost))
+        U = U[lost]
+
+    ncolors = int(color_map.max()) + 1 if nverts else 0
+    return ncolors, color_map, np.array(conflicts, np.uint64)
+
+# Bucket priority queues for the vertex orderings below: bucket k is a
+# doubly linked list (through nxt and prv, u32max-terminated) of the
+# vertices with key k, starting at head[k].
+
+@jit(void(uint32[:], uint32[:], uint32[:], uint32, uint32), nopython=True)
+def _bucket_insert(head, nxt, prv, v, k):
+    nxt[v] = head[k]
+    prv[v] = u32max
+    if head[k] != u32max:
+        prv[head[k]] = v
+    head[k] = v
+
+@jit(void(uint32[:], uint32[:], uint32[:], uint32, uint32), nopython=True)
+def _bucket_remove(head, nxt, prv, v, k):
+    if prv[v] != u32max:
+        nxt[prv[v]] = nxt[v]
+    else:
+        head[k] = nxt[v]
+    if nxt[v] != u32max:
+        prv[nxt[v]] = prv[v]
+
+# Matula-Beck smallest-last: repeatedly remove a vertex of minimum
+# degree in the remaining graph, and color in reverse removal order.
+# core[v] is the core number of v; returns the degeneracy.
+@jit(
+    uint32(uint32[:], uint64[:], uint32[:], uint32[:], uint32[:]),
+    nopython=True
+)
+def _smallest_last_compiled(adjacency, vertex_offsets, degree, order, core):
+    nverts = len(degree)
+    max_degree = degree.max() if nverts else 0
+    head = np.full(max_degree + 1, u32max, np.uint32)
+    nxt = np.empty(nverts, np.uint32)
+    prv = np.empty(nverts, np.uint32)
+    key = degree.copy()
+    removed = np.zeros(nverts, np.bool_)
+    for v in range(nverts):
+        _bucket_insert(head, nxt, prv, v, key[v])
+
+    lo = 0
+    degeneracy = 0
+    for i in range(nverts - 1, -1, -1):
+        while head[lo] == u32max:
+            lo += 1
+        v = head[lo]
+        _bucket_remove(head, nxt, prv, v, lo)
+        removed[v] = True
+        order[i] = v
+        degeneracy = max(degeneracy, lo)
+        core[v] = degeneracy
+        for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if not removed[u]:
+                _bucket_remove(head, nxt, prv, u, key[u])
+                key[u] -= 1
+                _bucket_insert(head, nxt, prv, u, key[u])
+                lo = min(lo, key[u])
+    return degeneracy
+
+# incidence degree: next is the vertex with the most already ordered
+# neighbors, ties initially broken by largest degree (largest_first).
+@jit(
+    void(uint32[:], uint64[:], uint32[:], uint32[:]),
+    nopython=True
+)
+def _incidence_degree_compiled(adjacency, vertex_offsets, largest_first, order):
+    nverts = len(largest_first)
+    head = np.full(nverts + 1, u32max, np.uint32)
+    nxt = np.empty(nverts, np.uint32)
+    prv = np.empty(nverts, np.uint32)
+    key = np.zeros(nverts, np.uint32)
+    ordered = np.zeros(nverts, np.bool_)
+    # LIFO buckets, so push the largest degree last
+    for v in largest_first[::-1]:
+        _bucket_insert(head, nxt, prv, v, 0)
+
+    hi = 0
+    for i in range(nverts):
+        while head[hi] == u32max:
+            hi -= 1
+        v = head[hi]
+        _bucket_remove(head, nxt, prv, v, hi)
+        ordered[v] = True
+        order[i] = v
+        for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if not ordered[u]:
+                _bucket_remove(head, nxt, prv, u, key[u])
+                key[u] += 1
+                _bucket_insert(head, nxt, prv, u, key[u])
+                hi = max(hi, key[u])
+
+# inserts key into the open addressing hash set table (u64max for
+# empty slots, len(table) a power of two), returning whether it was new
+@jit(boolean(uint64[:], uint64), nopython=True)
+def _hash_set_insert(table, key):
+    mask = uint64(len(table) - 1)
+    slot = (key * uint64(0x9E3779B97F4A7C15)) >> uint64(32)
+    while True:
+        slot &= mask
+        if table[slot] == key:
+            return False
+        if table[slot] == u64max:
+            table[slot] = key
+            return True
+        slot += uint64(1)
+
+# DSATUR: next is the uncolored vertex with the most distinct colors
+# among its neighbors, ties initially broken by largest degree. Colors
+# first fit as it goes, with seen holding the (vertex << 32) | color
+# pairs already counted towards saturation.
+@jit(
+    void(uint32[:], uint64[:], uint32[:], uint32[:], uint64[:]),
+    nopython=True
+)
+def _dsatur_compiled(adjacency, vertex_offsets, largest_first, order, seen):
+    nverts = len(largest_first)
+    head = np.full(nverts + 1, u32max, np.uint32)
+    nxt = np.empty(nverts, np.uint32)
+    prv = np.empty(nverts, np.uint32)
+    key = np.zeros(nverts, np.uint32)
+    color_map = np.full(nverts, u32max, np.uint32)
+    max_degree = uint64(0)
+    for v in range(nverts):
+        max_degree = max(max_degree, vertex_offsets[v + 1] - vertex_offsets[v])
+    forbidden = np.zeros(max_degree + 2, np.uint32)
+    for v in largest_first[::-1]:
+        _bucket_insert(head, nxt, prv, v, 0)
+
+    hi = 0
+    for i in range(nverts):
+        while head[hi] == u32max:
+            hi -= 1
+        v = head[hi]
+        _bucket_remove(head, nxt, prv, v, hi)
+        order[i] = v
+
+        vstart, vend = vertex_offsets[v], vertex_offsets[v + 1]
+        for u in adjacency[vstart:vend]:
+            if color_map[u] != u32max:
+                forbidden[color_map[u]] = i + 1
+        color = 0
+        while forbidden[color] == i + 1:
+            color += 1
+        color_map[v] = color
+
+        for u in adjacency[vstart:vend]:
+            if color_map[u] == u32max and _hash_set_insert(
+                    seen, (uint64(u) << uint64(32)) | uint64(color)):
+                _bucket_remove(head, nxt, prv, u, key[u])
+                key[u] += 1
+                _bucket_insert(head, nxt, prv, u, key[u])
+                hi = max(hi, key[u])
+
+vertex_orderings = ['largest_first', 'smallest_last', 'incidence_degree', 'dsatur']
+
+def vertex_ordering(order, degree, bidir_edges, vertex_offsets):
+    """
+    Returns the u32 vertex processing order for color_graph given
+    an ordering name from vertex_orderings:
+
+    largest_first - by decreasing degree
+    smallest_last - reversed minimum degree removal order, O(V + E);
+                    colors with at most degeneracy + 1 colors
+    incidence_degree - most already ordered neighbors first, O(V + E)
+    dsatur - most distinctly colored neighbors first, O(V + E) plus
+             a hash set of 32 bytes per adjacency entry
+    """
+    assert order in vertex_orderings, order
+    nverts = len(degree)
+    largest_first = np.argsort(degree)[::-1].astype(np.uint32)
+    if order == 'largest_first':
+        return largest_first
+
+    out = np.empty(nverts, np.uint32)
+    if order == 'smallest_last':
+        core = np.empty(nverts, np.uint32)
+        _smallest_last_compiled(bidir_edges, vertex_offsets, degree, out, core)
+    elif order == 'incidence_degree':
+        _incidence_degree_compiled(bidir_edges, vertex_offsets, largest_first, out)
+    else:
+        tablesz = 1 << int(2 * len(bidir_edges) + 1).bit_length()
+        seen = np.full(tablesz, u64max, np.uint64)
+        _dsatur_compiled(bidir_edges, vertex_offsets, largest_first, out, seen)
+    return out
+
+def color_graph(degree, bidir_edges, vertex_offsets, color_ub=2 ** 16, order='largest_first'):
+    """
+    Greedy first-fit coloring of the graph with sorted adjacency lists
+    bidir_edges[vertex_offsets[v]:vertex_offsets[v + 1]] (see build_adjacency).
+
+    order is either one of the vertex_orderings names (see vertex_ordering)
+    or an explicit u32 array of all vertices.
+
+    color_ub is only the initial capacity of the forbidden color
+    bitset, which grows as needed.
+
+    Returns (ncolors, color_map).
+    """
+    nverts = len(degree)
+    if isinstance(order, str):
+        order = vertex_ordering(order, degree, bidir_edges, vertex_offsets)
+
+    color_map = np.full(int(nverts), u32max, dtype=np.uint32)
+
+    ncolors = _color_graph_compiled(
+        order, bidir_edges, vertex_offsets,
+        color_map, color_ub, 0)
+
+    return ncolors, color_map
+
+# _color_graph_compiled where colors stop being offered once they have
+# max_card vertices: full holds a bit per full color, and is or'ed into
+# the forbidden colors of every vertex.
+@jit(
+    uint32(uint32[:], uint32[:], uint64[:], uint32[:], uint32, uint32),
+    nopython=True
+)
+def _color_graph_capped_compiled(
+    vertex_order, adjacency, vertex_offsets,
+    color_map, color_ub, max_card):
+    adjacent_colors = np.zeros(max(1, (color_ub + 63) // 64), np.uint64)
+    full = np.zeros(len(adjacent_colors), np.uint64)
+    sizes = np.zeros(64 * len(adjacent_colors), np.uint32)
+    ncolors = 0
+    for v in vertex_order:
+        # one more word than any color so far, so a free color always exists
+        nwords = (ncolors >> 6) + 1
+        if nwords > len(adjacent_colors):
+            adjacent_colors = np.zeros(2 * len(adjacent_colors), np.uint64)
+            grown = np.zeros(len(adjacent_colors), np.uint64)
+            grown[:len(full)] = full
+            full = grown
+            grown_sizes = np.zeros(64 * len(adjacent_colors), np.uint32)
+            grown_sizes[:len(sizes)] = sizes
+            sizes = grown_sizes
+
+        vstart, vend = vertex_offsets[v], vertex_offsets[v + 1]
+        for n in adjacency[vstart:vend]:
+            c = color_map[n]
+            if c != u32max:
+                adjacent_colors[c >> 6] |= uint64(1) << uint64(c & 63)
+
+        w = 0
+        while (adjacent_colors[w] | full[w]) == u64max:
+            w += 1
+        color = w * 64 + int64(trailing_zeros(~(adjacent_colors[w] | full[w])))
 
         ncolors = max(color + 1, ncolors)
         color_map[v] = color
+        sizes[color] += 1
+        if sizes[color] == max_card:
+            full[color >> 6] |= uint64(1) << uint64(color & 63)
 
-        if vend - vstart > ncolors:
-            adjacent_colors[:ncolors] = False
+        if vend - vstart > nwords:
+            adjacent_colors[:nwords] = 0
         else:
             for n in adjacency[vstart:vend]:
-                if color_map[n] != u32max:
-                    adjacent_colors[color_map[n]] = False
+                c = color_map[n]
+                if c != u32max:
+                    adjacent_colors[c >> 6] = 0
     return ncolors
 
-def color_graph(degree, bidir_edges, vertex_offsets, color_ub=2 ** 16):
+def color_graph_capped(
+        degree, bidir_edges, vertex_offsets, max_card=255,
+        order='largest_first', color_ub=2 ** 16):
+    """
+    color_graph with at most max_card vertices per color, so that the
+    color_remap codes of every color (0 for none, then 1 to color_cards)
+    fit in u8 for max_card=255 and u16 for 65535, and every color
+    stays within a LightGBM max_bin of max_card + 1.
+
+    Returns (ncolors, color_map).
+    """
+    assert max_card >= 1, max_card
     nverts = len(degree)
-    smallest_first = np.argsort(degree).astype(np.uint32)
-    largest_first = smallest_first[::-1]
+    if isinstance(order, str):
+        order = vertex_ordering(order, degree, bidir_edges, vertex_offsets)
 
     color_map = np.full(int(nverts), u32max, dtype=np.uint32)
-    # will segfault if you have >2**10 colors
-    adjacent_colors = np.zeros(color_ub, dtype=bool)
+    ncolors = _color_graph_capped_compiled(
+        order, bidir_edges, vertex_offsets,
+        color_map, color_ub, max_card)
+    return ncolors, color_map
+
+# Speculative (Gebremedhin-Manne) coloring rounds. Each round, the
+# uncolored vertices U (in priority order) are cut into blocks, and lane
+# l first-fit colors blocks l, l + nlanes, ..., so that all lanes move
+# through the priority order together, much like the sequential loop.
+# Neighbors colored concurrently may end up with the same color; of
+# those, the one with the larger rank is uncolored again for the next round.
+@jit(
+    void(uint32[:], uint32[:], uint64[:], uint32[:], uint32, uint32, uint32),
+    nopython=True,
+    parallel=True
+)
+def _speculative_color_compiled(
+    U, adjacency, vertex_offsets, color_map, max_degree, nlanes, block):
+    n = len(U)
+    nblocks = (n + block - 1) // block
+    for lane in prange(nlanes):
+        # forbidden[c] == i + 1 iff U[i] has a neighbor of color c;
+        # first fit never needs a color above max_degree
+        forbidden = np.zeros(max_degree + 2, np.uint32)
+        for b in range(lane, nblocks, nlanes):
+            for i in range(b * block, min(n, (b + 1) * block)):
+                v = U[i]
+                stamp = i + 1
+                for nbr in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+                    c = color_map[nbr]
+                    if c != u32max:
+                        forbidden[c] = stamp
+                color = 0
+                while forbidden[color] == stamp:
+                    color += 1
+                color_map[v] = color
 
+@jit(
+    uint64(uint32[:], uint32[:], uint64[:], uint32[:], uint32[:], boolean[:]),
+    nopython=True,
+    parallel=True
+)
+def _detect_conflicts_compiled(
+    U, adjacency, vertex_offsets, color_map, rank, lost):
+    nconflicts = 0
+    for i in prange(len(U)):
+        v = U[i]
+        c = color_map[v]
+        for nbr in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if color_map[nbr] == c and rank[nbr] < rank[v]:
+                lost[i] = True
+                nconflicts += 1
+                break
+    return nconflicts
+
+def color_graph_parallel(degree, bidir_edges, vertex_offsets, nlanes=None, block=64):
+    """
+    Parallel greedy coloring of the graph given as in color_graph, using
+    speculative coloring rounds with conflict detection over
+    the largest-first order. The color counts usually stay within
+    a few colors of color_graph.
+
+    nlanes defaults to the numba thread count.
+
+    Returns (ncolors, color_map, conflicts), where conflicts[r] is
+    the number of vertices recolored after round r, so there were
+    len(conflicts) rounds.
+    """
+    nverts = len(degree)
+    if nlanes is None:
+        nlanes = numba.config.NUMBA_NUM_THREADS
+    max_degree = int(degree.max()) if nverts else 0
+    largest_first = np.argsort(degree)[::-1].astype(np.uint32)
+    rank = np.empty(nverts, np.uint32)
+    rank[largest_first] = np.arange(nverts, dtype=np.uint32)
+
+    color_map = np.full(int(nverts), u32max, dtype=np.uint32)
+    U = largest_first
+    conflicts = []
+    while len(U):
+        color_map[U] = u32max
+        _speculative_color_compiled(
+            U, bidir_edges, vertex_offsets, color_map,
+            max_degree, nlanes, block)
+        lost = np.zeros(len(U), bool)
+        conflicts.append(_detect_conflicts_compiled(
+            U, bidir_edges, vertex_offsets, color_map, rank, lost))
+        U = U[lost]
+
+    ncolors = int(color_map.max()) + 1 if nverts else 0
+    return ncolors, color_map, np.array(conflicts, np.uint64)
+
+# Iterated greedy (Culberson): revisiting the vertices one whole color
+# class at a time, in any order of the classes, first-fit can only reuse
+# or lower colors, so it never needs more colors than it started with.
+# Lane l recolors from color_map with its own class order class_orders[l]
+# into color_maps[l], so each iteration tries nlanes class orders at once.
+@jit(
+    void(uint32[:], uint32[:, ::1], uint32[:], uint64[:],
+         uint32[:, ::1], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _iterated_greedy_compiled(
+    color_map, class_orders, adjacency, vertex_offsets, color_maps, ncolors):
+    nverts = len(color_map)
+    nclasses = class_orders.shape[1]
+    for lane in prange(class_orders.shape[0]):
+        # counting sort of the vertices by the rank of their class
+        rank = np.empty(nclasses, np.uint32)
+        for i in range(nclasses):
+            rank[class_orders[lane, i]] = i
+        starts = np.zeros(nclasses + 1, np.uint32)
+        for v in range(nverts):
+            starts[rank[color_map[v]] + 1] += 1
+        for i in range(nclasses):
+            starts[i + 1] += starts[i]
+        order = np.empty(nverts, np.uint32)
+        for v in range(nverts):
+            r = rank[color_map[v]]
+            order[starts[r]] = v
+            starts[r] += 1
+        out = color_maps[lane]
+        out[:] = u32max
+        ncolors[lane] = _color_graph_compiled(
+            order, adjacency, vertex_offsets, out, uint32(nclasses), uint32(0))
+
+# Greedy clique grown from s: cnt[u] counts the clique members adjacent
+# to u, so the candidates are the neighbors u of s with cnt[u] equal to
+# the clique size, of which the highest degree one is added.
+@jit(uint32(uint32[:], uint32[:], uint64[:], uint32), nopython=True)
+def _greedy_clique_compiled(degree, adjacency, vertex_offsets, s):
+    nbrs = adjacency[vertex_offsets[s]:vertex_offsets[s + 1]]
+    cnt = np.zeros(len(degree), np.uint32)
+    for u in nbrs:
+        cnt[u] = 1
+    size = uint32(1)
+    best = s
+    while best != u32max:
+        best = u32max
+        for u in nbrs:
+            if cnt[u] == size and (best == u32max or degree[u] > degree[best]):
+                best = u
+        if best != u32max:
+            size += 1
+            for u in adjacency[vertex_offsets[best]:vertex_offsets[best + 1]]:
+                cnt[u] += 1
+    return size
+
+@jit(
+    void(uint32[:], uint32[:], uint64[:], uint32[:], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _greedy_cliques_compiled(degree, adjacency, vertex_offsets, starts, sizes):
+    for i in prange(len(starts)):
+        sizes[i] = _greedy_clique_compiled(
+            degree, adjacency, vertex_offsets, starts[i])
+
+def clique_lower_bound(degree, bidir_edges, vertex_offsets, nstarts=64):
+    """
+    Lower bound on the number of colors of the graph given as in
+    color_graph: the largest of the greedy cliques grown from the
+    nstarts highest degree vertices.
+    """
+    starts = np.argsort(degree)[::-1][:nstarts].astype(np.uint32)
+    clique_sizes = np.zeros(len(starts), np.uint32)
+    _greedy_cliques_compiled(
+        degree, bidir_edges, vertex_offsets, starts, clique_sizes)
+    return int(clique_sizes.max()) if len(starts) else 0
+
+def recolor_iterated_greedy(
+        degree, bidir_edges, vertex_offsets, ncolors, color_map,
+        time_budget=10.0, max_iters=None, nlanes=None, nstarts=64,
+        seed=0, verbose=False):
+    """
+    Improves a coloring of the graph given as in color_graph with
+    iterated greedy recoloring, which never increases the color count.
+
+    Each iteration recolors the vertices class by class in nlanes class
+    orders in parallel (reverse, largest class first, smallest class
+    first, then random) and keeps the best. Iterations stop after
+    time_budget seconds, max_iters iterations, or once the color count
+    reaches the lower bound from greedy cliques grown from the nstarts
+    highest degree vertices.
+
+    nlanes defaults to the numba thread count.
+
+    Returns (ncolors, color_map, history, lower_bound), where history[i]
+    is the color count after i iterations.
+    """
+    nverts = len(degree)
+    if nlanes is None:
+        nlanes = numba.config.NUMBA_NUM_THREADS
+    nlanes = max(nlanes, 3)
+    lower_bound = clique_lower_bound(degree, bidir_edges, vertex_offsets, nstarts)
+
+    rng = np.random.default_rng(seed)
+    color_map = color_map.copy()
+    color_maps = np.empty((nlanes, nverts), np.uint32)
+    lane_ncolors = np.empty(nlanes, np.uint32)
+    history = [ncolors]
+    deadline = time.time() + time_budget
+    while ncolors > lower_bound and time.time() < deadline and (
+            max_iters is None or len(history) <= max_iters):
+        sizes = np.bincount(color_map, minlength=ncolors)
+        class_orders = np.empty((nlanes, ncolors), np.uint32)
+        class_orders[0] = np.arange(ncolors)[::-1]
+        class_orders[1] = np.argsort(-sizes, kind='stable')
+        class_orders[2] = np.argsort(sizes, kind='stable')
+        for lane in range(3, nlanes):
+            class_orders[lane] = rng.permutation(ncolors)
+        _iterated_greedy_compiled(
+            color_map, class_orders, bidir_edges, vertex_offsets,
+            color_maps, lane_ncolors)
+        best = int(np.argmin(lane_ncolors))
+        # ties are kept too, since the new classes may let later
+        # iterations do better
+        assert lane_ncolors[best] <= ncolors
+        ncolors = int(lane_ncolors[best])
+        color_map[:] = color_maps[best]
+        history.append(ncolors)
+        if verbose:
+            print('iteration {:4d} colors {:6d} ({:+d})'.format(
+                len(history) - 1, ncolors, history[-1] - history[-2]))
+    return ncolors, color_map, np.array(history, np.uint32), lower_bound
+
+# Connected components by min-label propagation with pointer jumping:
+# label[v] is always a vertex of v's component no larger than v, so
+# following labels converges on the smallest vertex of each component.
+# Concurrent updates only ever lower labels, so the races are benign.
+@jit(void(uint32[:], uint64[:], uint32[:]), nopython=True, parallel=True)
+def _component_labels_compiled(adjacency, vertex_offsets, label):
+    nverts = len(label)
+    for v in prange(nverts):
+        label[v] = v
+    changed = 1
+    while changed:
+        changed = 0
+        for v in prange(nverts):
+            m = label[v]
+            for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+                m = min(m, label[u])
+            if m < label[v]:
+                label[v] = m
+                changed += 1
+        for v in prange(nverts):
+            while label[v] != label[label[v]]:
+                label[v] = label[label[v]]
+
+def connected_components(bidir_edges, vertex_offsets):
+    """
+    Returns (ncomponents, components), where components[v] numbers the
+    connected components of the graph given as in color_graph by
+    their smallest vertex.
+    """
+    nverts = len(vertex_offsets) - 1
+    label = np.empty(nverts, np.uint32)
+    _component_labels_compiled(bidir_edges, vertex_offsets, label)
+    roots = label == np.arange(nverts, dtype=np.uint32)
+    ids = np.cumsum(roots, dtype=np.uint32) - 1
+    return int(roots.sum()), ids[label]
+
+# Components are independent, so each is colored first-fit on its own,
+# all starting from color 0. Component i's vertices, in coloring order,
+# are vertices[offsets[i]:offsets[i + 1]].
+@jit(
+    void(uint32[:], uint64[:], uint32[:], uint32[:], uint64[:], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _color_components_compiled(
+    sequence, offsets, vertices, adjacency, vertex_offsets, color_map):
+    for j in prange(len(sequence)):
+        i = sequence[j]
+        component = vertices[offsets[i]:offsets[i + 1]]
+        if len(component) == 1:
+            color_map[component[0]] = 0
+        else:
+            _color_graph_compiled(
+                component, adjacency, vertex_offsets, color_map, uint32(64), uint32(0))
+
+def color_components(degree, bidir_edges, vertex_offsets, order='largest_first'):
+    """
+    Greedy coloring of the graph given as in color_graph, one connected
+    component at a time, with the components colored in parallel and
+    the largest ones started first. Isolated vertices get color 0
+    directly, and every component reuses the same colors, so the color
+    count is the largest over the components.
+
+    order is as for color_graph, and is kept within each component.
+
+    Returns (ncolors, color_map, ncomponents, components), with the
+    latter two as for connected_components.
+    """
+    nverts = len(degree)
+    if isinstance(order, str):
+        order = vertex_ordering(order, degree, bidir_edges, vertex_offsets)
+    ncomponents, components = connected_components(bidir_edges, vertex_offsets)
+
+    vertices = order[np.argsort(components[order], kind='stable')]
+    sizes = np.bincount(components, minlength=ncomponents)
+    offsets = np.zeros(ncomponents + 1, np.uint64)
+    np.cumsum(sizes, out=offsets[1:])
+    sequence = np.argsort(-sizes, kind='stable').astype(np.uint32)
+
+    color_map = np.full(int(nverts), u32max, dtype=np.uint32)
+    _color_components_compiled(
+        sequence, offsets, vertices, bidir_edges, vertex_offsets, color_map)
+    ncolors = int(color_map.max()) + 1 if nverts else 0
+    return ncolors, color_map, ncomponents, components
+
+# Peels vertices of remaining degree below k, in peel order, into
+# peeled[:npeeled]; the rest (removed[v] false) are the k-core.
+@jit(
+    uint32(uint32[:], uint64[:], uint32[:], uint32, uint32[:], boolean[:]),
+    nopython=True
+)
+def _peel_compiled(adjacency, vertex_offsets, degree, k, peeled, removed):
+    remaining = degree.copy()
+    npeeled = 0
+    for v in range(len(degree)):
+        if remaining[v] < k:
+            removed[v] = True
+            peeled[npeeled] = v
+            npeeled += 1
+    i = 0
+    while i < npeeled:
+        v = peeled[i]
+        i += 1
+        for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if not removed[u]:
+                remaining[u] -= 1
+                if remaining[u] < k:
+                    removed[u] = True
+                    peeled[npeeled] = u
+                    npeeled += 1
+    return npeeled
+
+# Adjacency of the subgraph induced by vertices, where local[v] is v's
+# index in vertices or u32max, in that local numbering.
+@jit(
+    void(uint32[:], uint64[:], uint32[:], uint32[:], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _induced_degree_compiled(adjacency, vertex_offsets, local, vertices, degree):
+    for i in prange(len(vertices)):
+        v = vertices[i]
+        d = 0
+        for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if local[u] != u32max:
+                d += 1
+        degree[i] = d
+
+@jit(
+    void(uint32[:], uint64[:], uint32[:], uint32[:], uint64[:], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _induced_scatter_compiled(
+    adjacency, vertex_offsets, local, vertices, offsets, sub_adjacency):
+    for i in prange(len(vertices)):
+        v = vertices[i]
+        j = int64(offsets[i])
+        for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if local[u] != u32max:
+                sub_adjacency[j] = local[u]
+                j += 1
+
+def color_graph_peeled(
+        degree, bidir_edges, vertex_offsets, k=None, order='dsatur',
+        recolor_time_budget=0.0):
+    """
+    Colors the graph given as in color_graph by peeling vertices of
+    degree below k down to the k-core, coloring only the core with the
+    given order (as for color_graph, over the core), optionally improved
+    by recolor_iterated_greedy for recolor_time_budget seconds, and
+    finally coloring the peeled vertices first-fit in reverse peel order.
+
+    Each peeled vertex has fewer than k neighbors when it's colored, so
+    they never take the count past max(core colors, k). k defaults to
+    clique_lower_bound, which no coloring can beat anyway.
+
+    Returns (ncolors, color_map, ncore).
+    """
+    nverts = len(degree)
+    if k is None:
+        k = clique_lower_bound(degree, bidir_edges, vertex_offsets)
+    peeled = np.empty(nverts, np.uint32)
+    removed = np.zeros(nverts, bool)
+    npeeled = _peel_compiled(bidir_edges, vertex_offsets, degree, k, peeled, removed)
+    peeled = peeled[:npeeled]
+
+    core = np.flatnonzero(~removed).astype(np.uint32)
+    local = np.full(nverts, u32max, np.uint32)
+    local[core] = np.arange(len(core), dtype=np.uint32)
+    core_degree = np.empty(len(core), np.uint32)
+    _induced_degree_compiled(bidir_edges, vertex_offsets, local, core, core_degree)
+    core_offsets = np.empty(len(core) + 1, np.uint64)
+    parallel_cumsum(core_degree, core_offsets)
+    core_edges = np.empty(int(core_offsets[-1]), np.uint32)
+    _induced_scatter_compiled(
+        bidir_edges, vertex_offsets, local, core, core_offsets, core_edges)
+
+    color_map = np.full(int(nverts), u32max, dtype=np.uint32)
+    ncolors = 0
+    if len(core):
+        ncolors, core_colors = color_graph(
+            core_degree, core_edges, core_offsets, order=order)
+        if recolor_time_budget > 0:
+            ncolors, core_colors, _, _ = recolor_iterated_greedy(
+                core_degree, core_edges, core_offsets, ncolors, core_colors,
+                time_budget=recolor_time_budget)
+        color_map[core] = core_colors
+    # the peeled vertices' neighbors may hold any of the core's colors
     ncolors = _color_graph_compiled(
-        largest_first, bidir_edges, vertex_offsets,
-        color_map, adjacent_colors)
+        peeled[::-1].copy(), bidir_edges, vertex_offsets, color_map,
+        max(k, 1), ncolors)
+    return int(ncolors), color_map, len(core)
+
+def onehot_groups(nunique):
+    """
+    groups[b] is the categorical column that binary column b of onehot's
+    output came from, with the empty dummy column 0 put in group 0.
+    Each group's columns never share a row.
+    """
+    nunique = np.asarray(nunique, dtype=np.uint32)
+    groups = np.zeros(int(nunique.sum()) + 1, np.uint32)
+    groups[1:] = np.repeat(np.arange(len(nunique), dtype=np.uint32), nunique)
+    return groups
+
+@jit(uint64(uint32[:], uint32[:], uint64[:]), nopython=True, parallel=True)
+def _count_monochromatic_compiled(color_map, adjacency, vertex_offsets):
+    nbad = 0
+    for v in prange(len(color_map)):
+        for u in adjacency[vertex_offsets[v]:vertex_offsets[v + 1]]:
+            if color_map[u] == color_map[v]:
+                nbad += 1
+    return nbad
+
+def color_graph_grouped(
+        degree, bidir_edges, vertex_offsets, groups,
+        max_iters=1, time_budget=10.0, nlanes=None):
+    """
+    Colors the graph given as in color_graph starting from groups, a
+    partition of the vertices into sets known to have no edges inside,
+    such as the one-hot columns of one categorical column
+    (see onehot_groups). Each group starts out as its own color, and
+    recolor_iterated_greedy merges them from there for up to max_iters
+    iterations or time_budget seconds, so there are never more colors
+    than groups.
+
+    Returns (ncolors, color_map).
+    """
+    _, seed = np.unique(groups, return_inverse=True)
+    seed = seed.astype(np.uint32)
+    assert _count_monochromatic_compiled(seed, bidir_edges, vertex_offsets) == 0, \
+        'groups share edges'
+    ngroups = int(seed.max()) + 1 if len(seed) else 0
+    ncolors, color_map, _, _ = recolor_iterated_greedy(
+        degree, bidir_edges, vertex_offsets, ngroups, seed,
+        time_budget=time_budget, max_iters=max_iters, nlanes=nlanes)
+    return ncolors, color_map
+
+@jit(void(uint32[:], uint64[:]), nopython=True, parallel=True)
+def parallel_cumsum(x, out):
+    # out[0] = 0, out[i + 1] = x[0] + ... + x[i]
+    n = len(x)
+    nblocks = min(n, 1024)
+    sums = np.zeros(nblocks + 1, np.uint64)
+    for b in prange(nblocks):
+        total = uint64(0)
+        for i in range(b * n // nblocks, (b + 1) * n // nblocks):
+            total += x[i]
+        sums[b + 1] = total
+    for b in range(nblocks):
+        sums[b + 1] += sums[b]
+    out[0] = 0
+    for b in prange(nblocks):
+        total = sums[b]
+        for i in range(b * n // nblocks, (b + 1) * n // nblocks):
+            total += x[i]
+            out[i + 1] = total
+
+# hist[t, i] counts chunk t's entries for i, and is replaced in place by
+# the count of i's entries in chunks before t, so chunk t's entries for
+# i go from offsets[i] + hist[t, i]. total[i] gets the count over all
+# chunks, for parallel_cumsum(total, offsets).
+@jit(void(uint32[:, ::1], uint32[:]), nopython=True, parallel=True)
+def chunk_exclusive_prefix(hist, total):
+    nchunks = hist.shape[0]
+    for i in prange(hist.shape[1]):
+        lower = uint32(0)
+        for t in range(nchunks):
+            c = hist[t, i]
+            hist[t, i] = lower
+            lower += c
+        total[i] = lower
+
+def chunk_offsets(hist):
+    # runs chunk_exclusive_prefix and returns the offsets
+    total = np.empty(hist.shape[1], np.uint32)
+    chunk_exclusive_prefix(hist, total)
+    offsets = np.empty(hist.shape[1] + 1, np.uint64)
+    parallel_cumsum(total, offsets)
+    return offsets
+
+# The edges are sorted by (left, right), so split them into
+# hist.shape[0] contiguous chunks. Then the neighbors u < v of v are the
+# lefts of edges (u, v) in edge order, and the neighbors w > v are the
+# rights of the contiguous run of edges (v, w), from upper_start[v] to
+# upper_start[v + 1]. Each adjacency list is laid out as the former
+# followed by the latter, so it comes out sorted.
+#
+# hist[t, v] counts the edges (u, v) in chunk t, and is then
+# replaced by where chunk t's lower neighbors of v start.
+@jit(
+    [void(uint64[:], uint32[:, ::1], uint64[:], uint32[:]),
+     void(uint32[:], uint32[:, ::1], uint64[:], uint32[:])],
+    nopython=True,
+    parallel=True
+)
+def _adjacency_degree_compiled(edges, hist, upper_start, degree):
+    shift = uint32(edges.itemsize * 4)
+    nchunks = hist.shape[0]
+    nedges = len(edges)
+    nverts = len(degree)
+    for t in prange(nchunks):
+        for e in edges[t * nedges // nchunks:(t + 1) * nedges // nchunks]:
+            hist[t, right(e, shift)] += 1
+
+    for v in prange(nverts + 1):
+        upper_start[v] = np.searchsorted(edges, uint64(v) << shift)
+
+    for v in prange(nverts):
+        lower = uint32(0)
+        for t in range(nchunks):
+            c = hist[t, v]
+            hist[t, v] = lower
+            lower += c
+        degree[v] = lower + (upper_start[v + 1] - upper_start[v])
+
+# with with_counts, edge_counts[i] (the weight of edges[i]) is
+# scattered into bidir_counts alongside both of its adjacency entries
+@jit(
+    [void(uint64[:], uint32[:, ::1], uint64[:], uint64[:], uint32[::1],
+          uint32[:], uint32[::1], boolean),
+     void(uint32[:], uint32[:, ::1], uint64[:], uint64[:], uint32[::1],
+          uint32[:], uint32[::1], boolean)],
+    nopython=True,
+    parallel=True
+)
+def _adjacency_scatter_compiled(
+    edges, hist, upper_start, vertex_offsets, bidir_edges,
+    edge_counts, bidir_counts, with_counts):
+    shift = uint32(edges.itemsize * 4)
+    nchunks = hist.shape[0]
+    nedges = len(edges)
+    nverts = len(vertex_offsets) - 1
+    for t in prange(nchunks):
+        for i in range(t * nedges // nchunks, (t + 1) * nedges // nchunks):
+            l, r = left(edges[i], shift), right(edges[i], shift)
+            dst = vertex_offsets[r] + hist[t, r]
+            bidir_edges[dst] = l
+            if with_counts:
+                bidir_counts[dst] = edge_counts[i]
+            hist[t, r] += 1
+
+    for v in prange(nverts):
+        lo, hi = upper_start[v], upper_start[v + 1]
+        dst = vertex_offsets[v + 1] - (hi - lo)
+        for i in range(hi - lo):
+            bidir_edges[dst + i] = right(edges[lo + i], shift)
+            if with_counts:
+                bidir_counts[dst + i] = edge_counts[lo + i]
+
+def build_adjacency(edges, nverts, nchunks=None, edge_counts=None):
+    """
+    Accepts sorted, unique packed edges (u64 or u32, see create_edgeset)
+    over nverts vertices.
+
+    Returns (degree, bidir_edges, vertex_offsets), where
+    bidir_edges[vertex_offsets[v]:vertex_offsets[v + 1]] are the
+    sorted neighbors of v. If the u32 edge_counts parallel to edges are
+    given (see create_edgeset's counts), returns
+    (degree, bidir_edges, vertex_offsets, bidir_counts) with
+    bidir_counts parallel to bidir_edges.
+
+    Every step runs in parallel over nchunks chunks of the edges
+    (by default one per numba thread), using nchunks * nverts
+    u32 scratch space for per-chunk degree histograms.
+    """
+    nverts = int(nverts)
+    if nchunks is None:
+        nchunks = numba.config.NUMBA_NUM_THREADS
+    nchunks = max(1, min(nchunks, len(edges)))
+    hist = np.zeros((nchunks, nverts), np.uint32)
+    upper_start = np.zeros(nverts + 1, np.uint64)
+    degree = np.zeros(nverts, np.uint32)
+    _adjacency_degree_compiled(edges, hist, upper_start, degree)
+
+    vertex_offsets = np.zeros(nverts + 1, np.uint64)
+    parallel_cumsum(degree, vertex_offsets)
+
+    bidir_edges = np.zeros(len(edges) * 2, np.uint32)
+    with_counts = edge_counts is not None
+    bidir_counts = np.zeros(len(bidir_edges) if with_counts else 0, np.uint32)
+    if not with_counts:
+        edge_counts = bidir_counts
+    _adjacency_scatter_compiled(
+        edges, hist, upper_start, vertex_offsets, bidir_edges,
+        edge_counts, bidir_counts, with_counts)
+    if with_counts:
+        return degree, bidir_edges, vertex_offsets, bidir_counts
+    return degree, bidir_edges, vertex_offsets
+
+# Back-edge halves of the adjacency in rank space: each edge is kept only
+# at its later endpoint in the coloring order, pointing at the earlier one.
+# hist[t, i] counts chunk t's back-edges of rank i, then becomes where
+# they go in back_edges, relative to back_offsets[i].
+@jit(
+    [void(uint64[:], uint32[:], uint32[:, ::1]),
+     void(uint32[:], uint32[:], uint32[:, ::1])],
+    nopython=True,
+    parallel=True
+)
+def _half_degree_compiled(edges, rank, hist):
+    shift = uint32(edges.itemsize * 4)
+    nchunks = hist.shape[0]
+    nedges = len(edges)
+    for t in prange(nchunks):
+        for e in edges[t * nedges // nchunks:(t + 1) * nedges // nchunks]:
+            hist[t, max(rank[left(e, shift)], rank[right(e, shift)])] += 1
+
+@jit(
+    [void(uint64[:], uint32[:], uint32[:, ::1], uint64[:], uint32[:]),
+     void(uint32[:], uint32[:], uint32[:, ::1], uint64[:], uint32[:])],
+    nopython=True,
+    parallel=True
+)
+def _half_scatter_compiled(edges, rank, hist, back_offsets, back_edges):
+    shift = uint32(edges.itemsize * 4)
+    nchunks = hist.shape[0]
+    nedges = len(edges)
+    for t in prange(nchunks):
+        for e in edges[t * nedges // nchunks:(t + 1) * nedges // nchunks]:
+            a, b = rank[left(e, shift)], rank[right(e, shift)]
+            hi, lo = max(a, b), min(a, b)
+            back_edges[back_offsets[hi] + hist[t, hi]] = lo
+            hist[t, hi] += 1
+
+def half_adjacency(edges, order, nchunks=None):
+    """
+    Accepts packed edges (u64 or u32, see create_edgeset) and a vertex
+    order as for color_graph.
+
+    Returns (back_edges, back_offsets) in rank space, where i is the rank
+    of order[i]: back_edges[back_offsets[i]:back_offsets[i + 1]] are the
+    ranks of the neighbors of order[i] earlier in the order, unsorted.
+    That's every edge once, half of build_adjacency's bidir_edges, and
+    all that first-fit coloring in this order ever reads.
+    """
+    nverts = len(order)
+    if nchunks is None:
+        nchunks = numba.config.NUMBA_NUM_THREADS
+    nchunks = max(1, min(nchunks, len(edges)))
+    rank = np.empty(nverts, np.uint32)
+    rank[order] = np.arange(nverts, dtype=np.uint32)
+    hist = np.zeros((nchunks, nverts), np.uint32)
+    _half_degree_compiled(edges, rank, hist)
+
+    back_offsets = chunk_offsets(hist)
+    back_edges = np.empty(len(edges), np.uint32)
+    _half_scatter_compiled(edges, rank, hist, back_offsets, back_edges)
+    return back_edges, back_offsets
+
+def color_graph_half(edges, nverts, order=None, color_ub=2 ** 16):
+    """
+    color_graph straight from the packed edges through half_adjacency,
+    with order an explicit u32 array of all vertices, by default largest
+    first. In rank space the vertices are colored in sequence, each
+    reading only its back-edges.
 
+    Returns (ncolors, color_map).
+    """
+    nverts = int(nverts)
+    if order is None:
+        degree = np.zeros(nverts, np.uint32)
+        count_degree(edges, degree)
+        order = np.argsort(degree)[::-1].astype(np.uint32)
+    back_edges, back_offsets = half_adjacency(edges, order)
+    rank_colors = np.full(nverts, u32max, dtype=np.uint32)
+    ncolors = _color_graph_compiled(
+        np.arange(nverts, dtype=np.uint32), back_edges, back_offsets,
+        rank_colors, color_ub, 0)
+    color_map = np.empty(nverts, np.uint32)
+    color_map[order] = rank_colors
     return ncolors, color_map
 
+def color_graph_relabelled(edges, nverts, relabel='largest_first', order=None):
+    """
+    color_graph over packed edges after renumbering the vertices for
+    locality, so that the color_map lookups of neighbors hit nearby
+    entries:
+
+    a vertex_orderings name - number the vertices in that processing
+        order, which is then just 0, 1, 2, ... (largest_first, i.e.
+        clustered by degree, needs only the degrees; the others need the
+        original adjacency built first)
+    rcm - reverse Cuthill-McKee over the original adjacency, which puts
+        neighbors close together; vertices are then colored in the
+        given order (see color_graph, by default largest_first) over
+        the new numbering
+
+    order is only for rcm, since the other relabelings fix the order.
+
+    The adjacency is built, and colored, over the new numbering only.
+
+    Returns (ncolors, color_map) over the original vertices.
+    """
+    assert order is None or relabel == 'rcm', (relabel, order)
+    nverts = int(nverts)
+    if relabel == 'largest_first':
+        degree = np.zeros(nverts, np.uint32)
+        count_degree(edges, degree)
+        perm = np.argsort(degree)[::-1].astype(np.uint32)
+    else:
+        degree, bidir_edges, vertex_offsets = build_adjacency(edges, nverts)
+        if relabel == 'rcm':
+            A = sps.csr_matrix(
+                (np.ones(len(bidir_edges), np.int8), bidir_edges,
+                 vertex_offsets.astype(np.int64)), shape=(nverts, nverts))
+            perm = reverse_cuthill_mckee(A, symmetric_mode=True).astype(np.uint32)
+        else:
+            perm = vertex_ordering(relabel, degree, bidir_edges, vertex_offsets)
+        del degree, bidir_edges, vertex_offsets
+
+    new_ids = np.empty(nverts, np.uint32)
+    new_ids[perm] = np.arange(nverts, dtype=np.uint32)
+    degree, bidir_edges, vertex_offsets = build_adjacency(
+        relabel_edges(edges, new_ids), nverts)
+    if relabel != 'rcm':
+        order = np.arange(nverts, dtype=np.uint32)
+    elif order is None:
+        order = 'largest_first'
+    ncolors, new_colors = color_graph(degree, bidir_edges, vertex_offsets, order=order)
+    return ncolors, new_colors[new_ids]
+
+@jit(
+    uint64(int32[:], int32[:], uint32[:], uint32, boolean[:]),
+    nopython=True,
+    parallel=True
+)
+def _find_conflicts_compiled(
+    indptr, indices, color_map, ncolors, conflicted):
+    nrows = len(indptr) - 1
+    nchunks = min(nrows, 1024)
+    nconflicts = 0
+    for chunk in prange(nchunks):
+        # seen[c] is 1 + the last row with a vertex of color c
+        seen = np.zeros(ncolors, np.uint32)
+        for row in range(chunk * nrows // nchunks, (chunk + 1) * nrows // nchunks):
+            for v in indices[indptr[row]:indptr[row + 1]]:
+                c = color_map[v]
+                if seen[c] == row + 1:
+                    conflicted[v] = True
+                    nconflicts += 1
+                seen[c] = row + 1
+    return nconflicts
+
+def find_conflicts(Xbinary_csr, ncolors, color_map):
+    """
+    Checks a coloring against every row of Xbinary_csr.
+
+    Returns (nconflicts, conflicted), where conflicted marks vertices
+    that share a row with an earlier vertex (in column order) of the
+    same color, and nconflicts counts such (row, vertex) occurrences.
+    """
+    conflicted = np.zeros(len(color_map), bool)
+    nconflicts = _find_conflicts_compiled(
+        Xbinary_csr.indptr, Xbinary_csr.indices,
+        color_map, ncolors, conflicted)
+    return nconflicts, conflicted
+
+@jit(
+    uint32(uint32[:], int32[:], int32[:], int32[:], int32[:],
+           uint32[:], uint32),
+    nopython=True
+)
+def _recolor_from_rows_compiled(
+    vertices, csr_indptr, csr_indices, csc_indptr, csc_indices,
+    color_map, ncolors):
+    # forbidden[c] == i + 1 iff vertices[i] has a neighbor of color c,
+    # where the neighbors of v are read off the rows containing v
+    forbidden = np.zeros(ncolors + len(vertices), np.uint32)
+    for i, v in enumerate(vertices):
+        for row in csc_indices[csc_indptr[v]:csc_indptr[v + 1]]:
+            for n in csr_indices[csr_indptr[row]:csr_indptr[row + 1]]:
+                if n != v:
+                    forbidden[color_map[n]] = i + 1
+        color = 0
+        while forbidden[color] == i + 1:
+            color += 1
+        color_map[v] = color
+        ncolors = max(ncolors, color + 1)
+    return ncolors
+
+def repair_coloring(Xbinary_csr, ncolors, color_map, Xbinary_csc=None):
+    """
+    Fixes a coloring computed from an incomplete edge set (e.g. from
+    create_edgeset.create_edgeset_approx) in place, so that no row of
+    Xbinary_csr has two vertices of the same color.
+
+    Conflicting vertices are found in one parallel pass over the rows,
+    then greedily recolored one at a time against their full neighborhood,
+    read directly from the rows containing them.
+
+    Returns (ncolors, nrepaired).
+    """
+    _, conflicted = find_conflicts(Xbinary_csr, ncolors, color_map)
+    vertices = np.flatnonzero(conflicted).astype(np.uint32)
+    if len(vertices) == 0:
+        return ncolors, 0
+    if Xbinary_csc is None:
+        Xbinary_csc = Xbinary_csr.tocsc()
+    ncolors = _recolor_from_rows_compiled(
+        vertices,
+        Xbinary_csr.indptr, Xbinary_csr.indices,
+        Xbinary_csc.indptr, Xbinary_csc.indices,
+        color_map, ncolors)
+    return ncolors, len(vertices)
+
+def approximate_coloring(
+        Xbinary_csr, edgebufsz, rate, tqdm=None, nthreads=16,
+        heavy_nnz=None, heavy_rate=None, min_count=1, seed=0,
+        Xbinary_csc=None):
+    """
+    Colors the co-occurrence graph of Xbinary_csr from a sampled edge
+    set (see create_edgeset.create_edgeset_approx for the sampling
+    arguments), then repairs it against the full data, so the
+    result is a valid coloring, if maybe with a few more colors.
+
+    Returns (ncolors, color_map, nrepaired).
+    """
+    edges = create_edgeset_approx(
+        Xbinary_csr, edgebufsz, rate, tqdm, nthreads,
+        heavy_nnz, heavy_rate, min_count, seed)
+    degree, bidir_edges, vertex_offsets = build_adjacency(edges, Xbinary_csr.shape[1])
+    ncolors, color_map = color_graph(degree, bidir_edges, vertex_offsets)
+    ncolors, nrepaired = repair_coloring(Xbinary_csr, ncolors, color_map, Xbinary_csc)
+    return ncolors, color_map, nrepaired
+
+# EFB-style greedy bundling: cost[c] is the number of rows v shares with
+# vertices of color c (summed edge counts, so an upper bound), and v
+# joins the first color whose accumulated conflicts stay within budget.
+@jit(
+    uint32(uint32[:], uint32[:], uint64[:], uint32[:],
+           uint64, uint32[:], uint64[:]),
+    nopython=True
+)
+def _bundle_graph_compiled(
+    vertex_order, adjacency, vertex_offsets, adjacency_counts,
+    budget, color_map, conflicts):
+    cost = np.zeros(len(conflicts), np.uint64)
+    ncolors = 0
+    for v in vertex_order:
+        vstart, vend = vertex_offsets[v], vertex_offsets[v + 1]
+        for i in range(vstart, vend):
+            c = color_map[adjacency[i]]
+            if c != u32max:
+                cost[c] += adjacency_counts[i]
+
+        color = ncolors
+        for c in range(ncolors):
+            if conflicts[c] + cost[c] <= budget:
+                color = c
+                break
+
+        conflicts[color] += cost[color]
+        ncolors = max(color + 1, ncolors)
+        color_map[v] = color
+
+        for n in adjacency[vstart:vend]:
+            if color_map[n] != u32max:
+                cost[color_map[n]] = 0
+    return ncolors
+
+def bundle_graph(
+        degree, bidir_edges, vertex_offsets, bidir_counts,
+        max_conflict_rows, nrows=None, order='largest_first'):
+    """
+    Conflict-tolerant coloring, like LightGBM's exclusive feature bundling:
+    vertices of the same color (bundle) may co-occur in up to
+    max_conflict_rows rows per bundle, with the rows bidir_counts
+    (see build_adjacency with edge_counts) as the co-occurrence counts.
+
+    max_conflict_rows is an absolute row count if it's an int, or
+    else a fraction of nrows. order is as for color_graph. With a budget of
+    0 this is the same as color_graph.
+
+    Conflicting rows are resolved by color_remap.
+
+    Returns (ncolors, color_map, conflicts), where conflicts[c] bounds
+    the number of conflicting rows in bundle c from above.
+    """
+    if isinstance(max_conflict_rows, (float, np.floating)):
+        assert nrows is not None, 'fractional max_conflict_rows needs nrows'
+        max_conflict_rows = int(max_conflict_rows * nrows)
+    nverts = len(degree)
+    if isinstance(order, str):
+        order = vertex_ordering(order, degree, bidir_edges, vertex_offsets)
+
+    color_map = np.full(int(nverts), u32max, dtype=np.uint32)
+    conflicts = np.zeros(int(nverts) + 1, np.uint64)
+    ncolors = _bundle_graph_compiled(
+        order, bidir_edges, vertex_offsets, bidir_counts,
+        max_conflict_rows, color_map, conflicts)
+    return ncolors, color_map, conflicts[:ncolors]
+
+# Row bitmaps for bundling, in the style of roaring bitmaps: each bundle's
+# occupied rows are split into chunks of 2**16 rows, and each nonempty
+# chunk is a container, either a sorted u16 array of row offsets (up to
+# array_container_max of them) or a bitmap of bitmap_words words.
+# directory[c, h] is the container of bundle c's chunk h, or -1, and
+# containers[k] holds (is_bitmap, start, cardinality, capacity), where
+# start indexes pool16 for arrays and pool64 for bitmaps.
+array_container_max = 4096
+bitmap_words = 1024
+
+@jit(
+    int64(int64[::1], uint16[::1], uint64[::1],
+          uint16[::1], int64, int64, uint64[::1], int64),
+    nopython=True
+)
+def _container_card(container, pool16, pool64, qbuf, qstart, qlen, qbits, qbitstart):
+    if container[0] == 0:
+        if qbitstart < 0:
+            return C_card_array_array(
+                ffi_native.from_buffer(pool16), container[1], container[2],
+                ffi_native.from_buffer(qbuf), qstart, qlen)
+        return C_card_array_bitmap(
+            ffi_native.from_buffer(pool16), container[1], container[2],
+            ffi_native.from_buffer(qbits), qbitstart)
+    if qbitstart < 0:
+        return C_card_array_bitmap(
+            ffi_native.from_buffer(qbuf), qstart, qlen,
+            ffi_native.from_buffer(pool64), container[1])
+    return C_card_bitmap_bitmap(
+        ffi_native.from_buffer(pool64), container[1],
+        ffi_native.from_buffer(qbits), qbitstart)
+
+# pools only grow, so outgrown array containers are just abandoned,
+# which wastes at most as much as the capacity doubling does
+@jit(uint16[::1](uint16[::1], int64), nopython=True)
+def _reserve16(pool, need):
+    if need <= len(pool):
+        return pool
+    grown = np.empty(max(need, 2 * len(pool)), np.uint16)
+    grown[:len(pool)] = pool
+    return grown
+
+@jit(uint64[::1](uint64[::1], int64), nopython=True)
+def _reserve64(pool, need):
+    if need <= len(pool):
+        return pool
+    grown = np.empty(max(need, 2 * len(pool)), np.uint64)
+    grown[:len(pool)] = pool
+    return grown
+
+@jit(int64[:, ::1](int64[:, ::1], int64, int64), nopython=True)
+def _reserve_rows(x, need, fill):
+    if need <= x.shape[0]:
+        return x
+    grown = np.full((max(need, 2 * x.shape[0]), x.shape[1]), fill, np.int64)
+    grown[:x.shape[0]] = x
+    return grown
+
+@jit(
+    uint32(int32[:], int32[:], uint32[:], int64, int64, uint32[:], int64[:]),
+    nopython=True
+)
+def _bundle_row_bitmaps_compiled(
+        indptr, indices, column_order, nchunks, budget, color_map, conflicts):
+    ncolors = 0
+    directory = np.full((16, nchunks), -1, np.int64)
+    containers = np.zeros((64, 4), np.int64)
+    ncontainers = 0
+    pool16 = np.empty(1 << 16, np.uint16)
+    used16 = 0
+    pool64 = np.empty(16 * bitmap_words, np.uint64)
+    used64 = 0
+
+    maxnnz = 1
+    for v in range(len(indptr) - 1):
+        maxnnz = max(maxnnz, indptr[v + 1] - indptr[v])
+    # v's rows as query containers: offsets into qbuf, plus a bitmap in
+    # qbits for chunks too dense for an array container
+    qbuf = np.empty(maxnnz, np.uint16)
+    qbits = np.empty(nchunks * bitmap_words, np.uint64)
+    seg_chunk = np.empty(nchunks, np.int64)
+    seg_start = np.empty(nchunks, np.int64)
+    seg_len = np.empty(nchunks, np.int64)
+    seg_bits = np.empty(nchunks, np.int64)
+    merged = np.empty(2 * array_container_max, np.uint16)
+
+    for v in column_order:
+        lo, hi = indptr[v], indptr[v + 1]
+        nseg = 0
+        i = lo
+        while i < hi:
+            h = indices[i] >> 16
+            j = i
+            while j < hi and (indices[j] >> 16) == h:
+                qbuf[j - lo] = uint16(indices[j] & 0xffff)
+                j += 1
+            seg_chunk[nseg] = h
+            seg_start[nseg] = i - lo
+            seg_len[nseg] = j - i
+            seg_bits[nseg] = -1
+            if j - i > array_container_max:
+                b = nseg * bitmap_words
+                qbits[b:b + bitmap_words] = 0
+                for x in qbuf[i - lo:j - lo]:
+                    qbits[b + (x >> 6)] |= uint64(1) << (x & 63)
+                seg_bits[nseg] = b
+            nseg += 1
+            i = j
+
+        # first bundle which v's rows overlap in at most its remaining
+        # budget, stopping each count as soon as it's over
+        chosen = ncolors
+        cost = 0
+        for c in range(ncolors):
+            slack = budget - conflicts[c]
+            cost = 0
+            for s in range(nseg):
+                k = directory[c, seg_chunk[s]]
+                if k < 0:
+                    continue
+                cost += _container_card(
+                    containers[k], pool16, pool64,
+                    qbuf, seg_start[s], seg_len[s], qbits, seg_bits[s])
+                if cost > slack:
+                    break
+            if cost <= slack:
+                chosen = c
+                break
+        if chosen == ncolors:
+            cost = 0
+            ncolors += 1
+            directory = _reserve_rows(directory, ncolors, -1)
+        color_map[v] = chosen
+        conflicts[chosen] += cost
+
+        # union v's rows into the bundle's containers
+        for s in range(nseg):
+            h = seg_chunk[s]
+            qs, ql, qb = seg_start[s], seg_len[s], seg_bits[s]
+            k = directory[chosen, h]
+            if k < 0:
+                k = ncontainers
+                ncontainers += 1
+                containers = _reserve_rows(containers, ncontainers, 0)
+                directory[chosen, h] = k
+                if qb >= 0:
+                    pool64 = _reserve64(pool64, used64 + bitmap_words)
+                    pool64[used64:used64 + bitmap_words] = qbits[qb:qb + bitmap_words]
+                    containers[k, 0] = 1
+                    containers[k, 1] = used64
+                    containers[k, 3] = bitmap_words
+                    used64 += bitmap_words
+                else:
+                    cap = 16
+                    while cap < ql:
+                        cap *= 2
+                    pool16 = _reserve16(pool16, used16 + cap)
+                    pool16[used16:used16 + ql] = qbuf[qs:qs + ql]
+                    containers[k, 0] = 0
+                    containers[k, 1] = used16
+                    containers[k, 3] = cap
+                    used16 += cap
+                containers[k, 2] = ql
+                continue
+
+            start, card, cap = containers[k, 1], containers[k, 2], containers[k, 3]
+            new_card = card + ql - _container_card(
+                containers[k], pool16, pool64, qbuf, qs, ql, qbits, qb)
+            if containers[k, 0] == 0 and new_card <= array_container_max:
+                a, n = start, 0
+                for x in qbuf[qs:qs + ql]:
+                    while a < start + card and pool16[a] < x:
+                        merged[n] = pool16[a]
+                        n += 1
+                        a += 1
+                    if a < start + card and pool16[a] == x:
+                        a += 1
+                    merged[n] = x
+                    n += 1
+                while a < start + card:
+                    merged[n] = pool16[a]
+                    n += 1
+                    a += 1
+                if n > cap:
+                    while cap < n:
+                        cap *= 2
+                    pool16 = _reserve16(pool16, used16 + cap)
+                    start = used16
+                    used16 += cap
+                pool16[start:start + n] = merged[:n]
+                containers[k, 1] = start
+                containers[k, 3] = cap
+            else:
+                if containers[k, 0] == 0:
+                    # promote to a bitmap container
+                    pool64 = _reserve64(pool64, used64 + bitmap_words)
+                    b = used64
+                    used64 += bitmap_words
+                    pool64[b:b + bitmap_words] = 0
+                    for x in pool16[start:start + card]:
+                        pool64[b + (x >> 6)] |= uint64(1) << (x & 63)
+                    start = b
+                    containers[k, 0] = 1
+                    containers[k, 1] = b
+                    containers[k, 3] = bitmap_words
+                if qb >= 0:
+                    for w in range(bitmap_words):
+                        pool64[start + w] |= qbits[qb + w]
+                else:
+                    for x in qbuf[qs:qs + ql]:
+                        pool64[start + (x >> 6)] |= uint64(1) << (x & 63)
+            containers[k, 2] = new_card
+    return ncolors
+
+def bundle_row_bitmaps(
+        Xbinary_csr, max_conflict_rows=0, Xbinary_csc=None, order=None):
+    """
+    Exclusive feature bundling without an edge set: each bundle keeps the
+    set of rows it occupies as a compressed row bitmap, and each column
+    goes to the first bundle whose rows it overlaps in at most that
+    bundle's remaining budget of max_conflict_rows (an int, or a fraction
+    of the number of rows), found by intersection cardinalities alone.
+
+    Columns are visited in order, by default by decreasing nnz.
+    Xbinary_csc is Xbinary_csr.tocsc() with sorted int32 indices, made
+    here if not supplied.
+
+    Returns (ncolors, color_map, conflicts) like bundle_graph, except
+    that conflicts[c] is exact: the number of entries of bundle c's
+    columns landing on rows an earlier member already occupies.
+    """
+    nrows, nverts = Xbinary_csr.shape
+    if isinstance(max_conflict_rows, (float, np.floating)):
+        max_conflict_rows = int(max_conflict_rows * nrows)
+    if Xbinary_csc is None:
+        Xbinary_csc = Xbinary_csr.tocsc()
+        Xbinary_csc.sort_indices()
+        Xbinary_csc.indptr = Xbinary_csc.indptr.astype(np.int32)
+        Xbinary_csc.indices = Xbinary_csc.indices.astype(np.int32)
+    if order is None:
+        order = np.argsort(-np.diff(Xbinary_csc.indptr), kind='stable').astype(np.uint32)
+
+    nchunks = max((nrows + (1 << 16) - 1) >> 16, 1)
+    color_map = np.full(nverts, u32max, dtype=np.uint32)
+    conflicts = np.zeros(nverts + 1, np.int64)
+    ncolors = _bundle_row_bitmaps_compiled(
+        Xbinary_csc.indptr, Xbinary_csc.indices, order,
+        nchunks, max_conflict_rows, color_map, conflicts)
+    return ncolors, color_map, conflicts[:ncolors].astype(np.uint64)
+
+# Adjacency lists of just the marked vertices, straight from the packed
+# edges: local[v] is v's index among the marked vertices (or u32max), and
+# hist[t, i] counts the chunk t edges touching marked vertex i, then
+# chunk_exclusive_prefix makes it where chunk t's neighbors of i go in
+# adjacency, relative to offsets[i].
+@jit(
+    [void(uint64[:], uint32[:], uint32[:, ::1]),
+     void(uint32[:], uint32[:], uint32[:, ::1])],
+    nopython=True,
+    parallel=True
+)
+def _marked_degree_compiled(edges, local, hist):
+    shift = uint32(edges.itemsize * 4)
+    nchunks = hist.shape[0]
+    nedges = len(edges)
+    for t in prange(nchunks):
+        for e in edges[t * nedges // nchunks:(t + 1) * nedges // nchunks]:
+            l, r = left(e, shift), right(e, shift)
+            if local[l] != u32max:
+                hist[t, local[l]] += 1
+            if local[r] != u32max:
+                hist[t, local[r]] += 1
+
+@jit(
+    [void(uint64[:], uint32[:], uint32[:, ::1], uint64[:], uint32[:]),
+     void(uint32[:], uint32[:], uint32[:, ::1], uint64[:], uint32[:])],
+    nopython=True,
+    parallel=True
+)
+def _marked_scatter_compiled(edges, local, hist, offsets, adjacency):
+    shift = uint32(edges.itemsize * 4)
+    nchunks = hist.shape[0]
+    nedges = len(edges)
+    for t in prange(nchunks):
+        for e in edges[t * nedges // nchunks:(t + 1) * nedges // nchunks]:
+            l, r = left(e, shift), right(e, shift)
+            if local[l] != u32max:
+                adjacency[offsets[local[l]] + hist[t, local[l]]] = r
+                hist[t, local[l]] += 1
+            if local[r] != u32max:
+                adjacency[offsets[local[r]] + hist[t, local[r]]] = l
+                hist[t, local[r]] += 1
+
+def marked_adjacency(edges, nverts, vertices, nchunks=None):
+    """
+    Returns (adjacency, offsets) such that adjacency[offsets[i]:offsets[i + 1]]
+    are the neighbors of vertices[i] under the packed edges, in
+    one parallel scan over the edges with scratch proportional to
+    len(vertices) rather than nverts.
+    """
+    if nchunks is None:
+        nchunks = numba.config.NUMBA_NUM_THREADS
+    nchunks = max(1, min(nchunks, len(edges)))
+    local = np.full(int(nverts), u32max, np.uint32)
+    local[vertices] = np.arange(len(vertices), dtype=np.uint32)
+    hist = np.zeros((nchunks, len(vertices)), np.uint32)
+    _marked_degree_compiled(edges, local, hist)
+
+    offsets = chunk_offsets(hist)
+    adjacency = np.zeros(int(offsets[-1]), np.uint32)
+    _marked_scatter_compiled(edges, local, hist, offsets, adjacency)
+    return adjacency, offsets
+
+# first fit recoloring of vertices[i] in the given order of i, where
+# the neighbors of vertices[i] are adjacency[offsets[i]:offsets[i + 1]]
+@jit(
+    uint32(uint32[:], uint32[:], uint32[:], uint64[:], uint32[:], uint32),
+    nopython=True
+)
+def _recolor_marked_compiled(
+    vertices, order, adjacency, offsets, color_map, ncolors):
+    forbidden = np.zeros(ncolors + len(vertices) + 1, np.uint32)
+    for i in order:
+        v = vertices[i]
+        for n in adjacency[offsets[i]:offsets[i + 1]]:
+            if color_map[n] != u32max:
+                forbidden[color_map[n]] = i + 1
+        color = 0
+        while forbidden[color] == i + 1:
+            color += 1
+        color_map[v] = color
+        ncolors = max(ncolors, color + 1)
+    return ncolors
+
+def recolor_added_edges(edges, fresh, color_map, nverts=None, nthreads=16):
+    """
+    Repairs a coloring after the sorted edges fresh were added to the
+    graph, so that edges (which includes fresh) is the new edge set.
+    Vertices at or past len(color_map), up to nverts, are new.
+
+    For each fresh edge whose endpoints share a color, the one with the
+    smaller degree is recolored (unless the other already is), along with
+    all new vertices, first fit, largest degree first, against their
+    full neighborhoods, which are found in one scan over edges.
+
+    Returns (color_map, ncolors, diff) where diff = (vertices,
+    old_colors, new_colors) lists every vertex whose color changed;
+    old_colors are u32max for new vertices.
+    """
+    nverts = len(color_map) if nverts is None else int(nverts)
+    return _recolor_fresh(
+        fresh, color_map, nverts,
+        lambda vertices: marked_adjacency(edges, nverts, vertices, nthreads))
+
+def _recolor_fresh(fresh, color_map, nverts, neighborhoods):
+    # recolor_added_edges, with neighborhoods(vertices) giving the
+    # (adjacency, offsets) of the sorted vertices as marked_adjacency does
+    nold = len(color_map)
+    old_color_map = color_map
+    color_map = np.full(nverts, u32max, np.uint32)
+    color_map[:nold] = old_color_map
+    ncolors = int(old_color_map.max()) + 1 if nold else 0
+
+    shift = edge_shift(fresh)
+    fl = (fresh >> fresh.dtype.type(shift)).astype(np.uint32)
+    fr = (fresh - (fl.astype(fresh.dtype) << fresh.dtype.type(shift))).astype(np.uint32)
+    clash = (color_map[fl] == color_map[fr]) & (color_map[fl] != u32max)
+    fl, fr = fl[clash], fr[clash]
+
+    # the neighborhoods of every vertex that may be recolored, the clash
+    # endpoints and the new vertices, all at once
+    candidates = np.union1d(
+        np.concatenate([fl, fr]), np.arange(nold, nverts)).astype(np.uint32)
+    adjacency, offsets = neighborhoods(candidates)
+    degree = np.diff(offsets)
+
+    # the smaller degree endpoint of each clash, unless the other
+    # is already being recolored
+    marked = candidates >= nold
+    for l, r in zip(np.searchsorted(candidates, fl), np.searchsorted(candidates, fr)):
+        if not (marked[l] or marked[r]):
+            marked[l if degree[l] < degree[r] else r] = True
+
+    pick = np.flatnonzero(marked)
+    vertices = candidates[pick]
+    order = pick[np.argsort(degree[pick])[::-1]].astype(np.uint32)
+    color_map[vertices] = u32max
+    ncolors = _recolor_marked_compiled(
+        candidates, order, adjacency, offsets, color_map, ncolors)
+
+    before = np.full(len(vertices), u32max, np.uint32)
+    is_old = vertices < nold
+    before[is_old] = old_color_map[vertices[is_old]]
+    changed = before != color_map[vertices]
+    diff = (vertices[changed], before[changed], color_map[vertices[changed]])
+    return color_map, ncolors, diff
+
+# missing[i] is whether new_edges[i] = (l, r) is absent from the CSR
+# adjacency, by binary search in the sorted neighbors of l
+@jit(
+    [void(uint64[:], uint32[:], uint64[:], boolean[:]),
+     void(uint32[:], uint32[:], uint64[:], boolean[:])],
+    nopython=True,
+    parallel=True
+)
+def _csr_missing_compiled(new_edges, adjacency, offsets, missing):
+    shift = uint32(new_edges.itemsize * 4)
+    for i in prange(len(new_edges)):
+        l, r = left(new_edges[i], shift), right(new_edges[i], shift)
+        lo, hi = int64(offsets[l]), int64(offsets[l + 1])
+        end = hi
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if adjacency[mid] < r:
+                lo = mid + 1
+            else:
+                hi = mid
+        missing[i] = lo == end or adjacency[lo] != r
+
+# out[pos[i]:] gets the neighbors of vertices[i] from the CSR adjacency,
+# or from the pending run[lo[i]:hi[i]], and pos[i] moves past them
+@jit(
+    void(uint32[:], uint32[:], uint64[:], uint32[:], uint64[:]),
+    nopython=True,
+    parallel=True
+)
+def _gather_csr_compiled(vertices, adjacency, offsets, out, pos):
+    for i in prange(len(vertices)):
+        v = vertices[i]
+        lo, hi, p = int64(offsets[v]), int64(offsets[v + 1]), int64(pos[i])
+        out[p:p + hi - lo] = adjacency[lo:hi]
+        pos[i] = p + hi - lo
+
+@jit(
+    void(uint64[:], int64[:], int64[:], uint32[:], uint64[:]),
+    nopython=True,
+    parallel=True
+)
+def _gather_run_compiled(run, lo, hi, out, pos):
+    for i in prange(len(lo)):
+        p = int64(pos[i])
+        for j in range(lo[i], hi[i]):
+            out[p] = uint32(run[j] & uint64(u32max))
+            p += 1
+        pos[i] = p
+
+# merges the sorted CSR neighbors of each v with its sorted pending ones,
+# the low halves of pending[plo[v]:plo[v + 1]], into new_adjacency
+@jit(
+    void(uint32[:], uint64[:], uint64[:], int64[:], uint64[:], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _compact_compiled(adjacency, offsets, pending, plo, new_offsets, new_adjacency):
+    for v in prange(len(new_offsets) - 1):
+        a, a_end = int64(offsets[v]), int64(offsets[v + 1])
+        b, b_end = plo[v], plo[v + 1]
+        o = int64(new_offsets[v])
+        while a < a_end or b < b_end:
+            if b == b_end or (
+                    a < a_end and adjacency[a] < uint32(pending[b] & uint64(u32max))):
+                new_adjacency[o] = adjacency[a]
+                a += 1
+            else:
+                new_adjacency[o] = uint32(pending[b] & uint64(u32max))
+                b += 1
+            o += 1
+
+# upper[v] counts the neighbors n > v, which the fill then packs as
+# (v << shift) | n from out[upper_offsets[v]] on
+@jit(void(uint32[:], uint64[:], uint32[:]), nopython=True, parallel=True)
+def _upper_degree_compiled(adjacency, offsets, upper):
+    for v in prange(len(upper)):
+        n = uint32(0)
+        for u in adjacency[offsets[v]:offsets[v + 1]]:
+            if u > v:
+                n += 1
+        upper[v] = n
+
+@jit(
+    [void(uint32[:], uint64[:], uint64[:], uint64[:]),
+     void(uint32[:], uint64[:], uint64[:], uint32[:])],
+    nopython=True,
+    parallel=True
+)
+def _upper_edges_compiled(adjacency, offsets, upper_offsets, out):
+    shift = uint64(out.itemsize * 4)
+    for v in prange(len(upper_offsets) - 1):
+        o = int64(upper_offsets[v])
+        for u in adjacency[offsets[v]:offsets[v + 1]]:
+            if u > v:
+                out[o] = (uint64(v) << shift) | uint64(u)
+                o += 1
+
+class IncrementalAdjacency:
+    """
+    The adjacency of a graph that only gains edges and vertices, indexed
+    by vertex, so that adding a batch of edges and reading some
+    vertices' neighborhoods cost time in the batch and in those
+    neighborhoods rather than in the whole graph (see color_incremental).
+
+    Compacted edges are in CSR form, the neighbors of v being the sorted
+    adjacency[offsets[v]:offsets[v + 1]]. Edges added since are in
+    pending runs of sorted packed u64 (v << 32) | n, each edge in both
+    directions. A new run is merged into the one before while it's at
+    least as long, so there are O(log) runs and each edge is merged
+    O(log) times, and the runs are folded into the CSR once they pass
+    compact_ratio times its edges, which costs O(1 / compact_ratio)
+    amortized per added edge. offsets has room for capacity vertices,
+    doubled as new ones arrive.
+    """
+
+    def __init__(self, edges, nverts, compact_ratio=0.25, nchunks=None):
+        """
+        Builds the CSR from sorted, unique packed edges (u64 or u32)
+        over nverts vertices, once, in time in the whole graph.
+        """
+        self.nverts = int(nverts)
+        _, self.adjacency, self.offsets = build_adjacency(edges, self.nverts, nchunks)
+        self.compact_ratio = compact_ratio
+        self.runs = []
+
+    @property
+    def capacity(self):
+        return len(self.offsets) - 1
+
+    @property
+    def npending(self):
+        return sum(len(run) for run in self.runs) // 2
+
+    def grow(self, nverts):
+        """
+        Makes room for vertices up to nverts, with no edges yet.
+        """
+        nverts = int(nverts)
+        if nverts > self.capacity:
+            offsets = np.empty(max(nverts, 2 * self.capacity) + 1, np.uint64)
+            offsets[:len(self.offsets)] = self.offsets
+            offsets[len(self.offsets):] = self.offsets[-1]
+            self.offsets = offsets
+        self.nverts = max(self.nverts, nverts)
+
+    def missing(self, new_edges):
+        """
+        The sorted, unique packed new_edges (u64 or u32, over at most
+        nverts vertices) that aren't in the graph yet.
+        """
+        missing = np.empty(len(new_edges), bool)
+        _csr_missing_compiled(new_edges, self.adjacency, self.offsets, missing)
+        fresh = new_edges[missing]
+        if self.runs and len(fresh):
+            keys = self._pending_keys(fresh)
+            absent = np.ones(len(fresh), bool)
+            for run in self.runs:
+                ix = np.minimum(np.searchsorted(run, keys), len(run) - 1)
+                absent &= run[ix] != keys
+            fresh = fresh[absent]
+        return fresh
+
+    @staticmethod
+    def _pending_keys(edges, both=False):
+        # packed edges as (l << 32) | r, and (r << 32) | l too with both
+        shift = edge_shift(edges)
+        l = (edges >> edges.dtype.type(shift)).astype(np.uint64)
+        r = edges.astype(np.uint64) - (l << np.uint64(shift))
+        keys = (l << np.uint64(32)) | r
+        if both:
+            keys = np.concatenate([keys, (r << np.uint64(32)) | l])
+        return keys
+
+    def add(self, fresh):
+        """
+        Adds the packed edges fresh, which must be missing (see missing).
+        """
+        if len(fresh) == 0:
+            return
+        self.runs.append(merge(self._pending_keys(fresh, both=True)))
+        while len(self.runs) > 1 and len(self.runs[-1]) >= len(self.runs[-2]):
+            b, a = self.runs.pop(), self.runs.pop()
+            self.runs.append(np.insert(a, np.searchsorted(a, b), b))
+        if self.npending > self.compact_ratio * (len(self.adjacency) // 2):
+            self.compact()
+
+    def compact(self):
+        """
+        Folds the pending runs into the CSR, in time in the whole graph.
+        """
+        if not self.runs:
+            return
+        pending = self.runs[0] if len(self.runs) == 1 else merge(np.concatenate(self.runs))
+        plo = np.searchsorted(
+            pending, np.arange(self.capacity + 1, dtype=np.uint64) << np.uint64(32))
+        degree = (np.diff(self.offsets).astype(np.int64) + np.diff(plo)).astype(np.uint32)
+        offsets = np.empty(self.capacity + 1, np.uint64)
+        parallel_cumsum(degree, offsets)
+        adjacency = np.empty(int(offsets[-1]), np.uint32)
+        _compact_compiled(
+            self.adjacency, self.offsets, pending, plo.astype(np.int64), offsets, adjacency)
+        self.adjacency, self.offsets, self.runs = adjacency, offsets, []
+
+    def neighborhoods(self, vertices):
+        """
+        Returns (adjacency, offsets) such that adjacency[offsets[i]:offsets[i + 1]]
+        are the neighbors of vertices[i], unsorted, as marked_adjacency
+        does, in time in those neighborhoods.
+        """
+        vertices = np.asarray(vertices, np.uint32)
+        degree = (self.offsets[vertices + 1] - self.offsets[vertices]).astype(np.int64)
+        keys = vertices.astype(np.uint64) << np.uint64(32)
+        bounds = []
+        for run in self.runs:
+            lo = np.searchsorted(run, keys).astype(np.int64)
+            hi = np.searchsorted(run, keys + np.uint64(1 << 32)).astype(np.int64)
+            degree += hi - lo
+            bounds.append((run, lo, hi))
+        offsets = np.empty(len(vertices) + 1, np.uint64)
+        parallel_cumsum(degree.astype(np.uint32), offsets)
+        adjacency = np.empty(int(offsets[-1]), np.uint32)
+        pos = offsets[:-1].copy()
+        _gather_csr_compiled(vertices, self.adjacency, self.offsets, adjacency, pos)
+        for run, lo, hi in bounds:
+            _gather_run_compiled(run, lo, hi, adjacency, pos)
+        return adjacency, offsets
+
+    def edges(self):
+        """
+        Compacts, then returns the sorted, unique packed edges, with u32
+        keys if there are at most u32_key_nverts vertices and u64 ones
+        otherwise, as create_edgeset would.
+        """
+        self.compact()
+        key_dtype = np.uint32 if self.nverts <= u32_key_nverts else np.uint64
+        upper = np.empty(self.nverts, np.uint32)
+        _upper_degree_compiled(self.adjacency, self.offsets, upper)
+        upper_offsets = np.empty(self.nverts + 1, np.uint64)
+        parallel_cumsum(upper, upper_offsets)
+        out = np.empty(int(upper_offsets[-1]), key_dtype)
+        _upper_edges_compiled(self.adjacency, self.offsets, upper_offsets, out)
+        return out
+
+def color_incremental(graph, color_map, Xnew_csr, edgebufsz, tqdm=None, nthreads=16):
+    """
+    Updates a persisted coloring with a new batch of rows Xnew_csr,
+    whose columns are the old vertices followed by any new ones.
+
+    graph - the IncrementalAdjacency the coloring is valid for (from a
+            previous call), which is updated in place, or the sorted,
+            unique packed edges to build one from, once
+    color_map - the coloring of those edges, with one entry per old vertex
+
+    Only the new rows are expanded into edges, which are looked up and
+    added by vertex, and only vertices that now conflict and new
+    vertices are recolored (see recolor_added_edges), reading just
+    their neighborhoods. So a refresh takes time in the new rows' edges
+    and those neighborhoods, plus graph's amortized compactions and a
+    copy of the O(nverts) color_map, but not in the persisted edges.
+
+    Returns (graph, color_map, ncolors, diff) where graph and color_map
+    are the new ones to persist (graph.edges() has the packed edges),
+    and diff is as for recolor_added_edges.
+    """
+    nverts = Xnew_csr.shape[1]
+    assert nverts >= len(color_map), (nverts, len(color_map))
+
+    if not isinstance(graph, IncrementalAdjacency):
+        graph = IncrementalAdjacency(graph, len(color_map))
+    graph.grow(nverts)
+    new_edges = create_edgeset(Xnew_csr, edgebufsz, tqdm, nthreads)
+    fresh = graph.missing(new_edges)
+    graph.add(fresh)
+
+    color_map, ncolors, diff = _recolor_fresh(
+        fresh, color_map, nverts, graph.neighborhoods)
+    return graph, color_map, ncolors, diff
+
+@jit(
+    [void(uint64[:], uint32[:], uint64[:]),
+     void(uint32[:], uint32[:], uint64[:])],
+    nopython=True,
+    parallel=True
+)
+def _color_pairs_compiled(edges, color_map, out):
+    shift = uint32(edges.itemsize * 4)
+    for i in prange(len(edges)):
+        cl = color_map[left(edges[i], shift)]
+        cr = color_map[right(edges[i], shift)]
+        out[i] = (uint64(min(cl, cr)) << uint64(32)) | uint64(max(cl, cr))
+
+def merge_colors(edges, color_map, ncolors, order='largest_first'):
+    """
+    Merges color classes with no edges between them, e.g. after edges
+    expired from the graph (see create_edgeset.WindowedEdgeSet).
+
+    The classes are greedily colored as vertices of the quotient graph,
+    with an edge between two classes iff some edge of the graph joins
+    them; order is as for color_graph. This never increases the
+    number of colors.
+
+    Returns (ncolors, color_map), with color_map a new array.
+    """
+    pairs = np.empty(len(edges), np.uint64)
+    _color_pairs_compiled(edges, color_map, pairs)
+    if len(pairs):
+        pairs = merge(pairs)
+    degree, bidir_edges, vertex_offsets = build_adjacency(pairs, ncolors)
+    nmerged, class_color = color_graph(degree, bidir_edges, vertex_offsets, order=order)
+    if nmerged >= ncolors:
+        return ncolors, color_map.copy()
+    return nmerged, class_color[color_map]
+
+@jit(
+    void(int32[:], int32[:], uint32[:], uint32, boolean[:]),
+    nopython=True,
+    parallel=True
+)
+def _row_color_winners_compiled(indptr, indices, color_map, ncolors, keep):
+    nrows = len(indptr) - 1
+    nchunks = min(nrows, 1024)
+    for chunk in prange(nchunks):
+        # seen[c] is 1 + the last row with a vertex of color c
+        seen = np.zeros(ncolors, np.uint32)
+        for row in range(chunk * nrows // nchunks, (chunk + 1) * nrows // nchunks):
+            for i in range(indptr[row], indptr[row + 1]):
+                c = color_map[indices[i]]
+                keep[i] = seen[c] != row + 1
+                seen[c] = row + 1
+
 @jit(void(uint32[:], uint32[:, ::1], uint32[:]), nopython=True)
 def _color_remap_compiled(
         remap_map,
@@ -218,6 +2340,15 @@ def _color_remap_compiled(
 
 
 def color_remap(Xbinary_csr, ncolors, color_map, nnzr):
+    """
+    Collapses Xbinary_csr into one categorical column per color.
+
+    If a row has several vertices of the same color (only possible
+    after bundle_graph), the one with the smallest column index wins
+    and the others are dropped from that row.
+
+    Returns (Xcategorical_color, color_cards).
+    """
     nverts = Xbinary_csr.shape[1]
     nrows = Xbinary_csr.shape[0]
     color_coded = np.zeros((nrows, ncolors), dtype=np.uint32)
@@ -225,6 +2356,11 @@ def color_remap(Xbinary_csr, ncolors, color_map, nnzr):
 
     row_ix = np.repeat(np.arange(0, nrows, dtype=np.uint32), nnzr)
     active_columns = Xbinary_csr.indices
+    keep = np.empty(len(active_columns), bool)
+    _row_color_winners_compiled(
+        Xbinary_csr.indptr, Xbinary_csr.indices, color_map, ncolors, keep)
+    if not keep.all():
+        row_ix, active_columns = row_ix[keep], active_columns[keep]
     colors = color_map[active_columns]
     color_coded[row_ix, colors] = active_columns
     color_coded_T[colors, row_ix] = active_columns
@@ -241,6 +2377,323 @@ def color_remap(Xbinary_csr, ncolors, color_map, nnzr):
 
     return Xcategorical_color, color_cards
 
+# Member codes straight from color_map in one pass over the vertices:
+# the present vertices of each color get codes 1, 2, ... in column order.
+@jit(void(uint32[:], boolean[:], uint32[:], uint32[:]), nopython=True)
+def _member_codes_compiled(color_map, present, codes, color_cards):
+    for v in range(len(color_map)):
+        if present[v]:
+            c = color_map[v]
+            color_cards[c] += 1
+            codes[v] = color_cards[c]
+
+# One pass over blocks of rows, each color written to its own row of the
+# slab for its width (slot[c] in slab8, slab16 or slab32 for width[c] of
+# 1, 2 or 4 bytes, while width 0 colors are stored sparse, see below).
+# Columns come in order and codes are at least 1, so the smallest column
+# of a color wins its row.
+@jit(
+    void(int32[:], int32[:], uint32[:], uint32[:], uint8[:], uint32[:],
+         uint8[:, ::1], uint16[:, ::1], uint32[:, ::1], int64),
+    nopython=True,
+    parallel=True
+)
+def _stream_remap_compiled(
+    indptr, indices, color_map, codes, width, slot,
+    slab8, slab16, slab32, block):
+    nrows = len(indptr) - 1
+    nblocks = (nrows + block - 1) // block
+    for b in prange(nblocks):
+        for row in range(b * block, min(nrows, (b + 1) * block)):
+            for i in range(indptr[row], indptr[row + 1]):
+                v = indices[i]
+                c = color_map[v]
+                s = slot[c]
+                if width[c] == 1:
+                    if slab8[s, row] == 0:
+                        slab8[s, row] = codes[v]
+                elif width[c] == 2:
+                    if slab16[s, row] == 0:
+                        slab16[s, row] = codes[v]
+                elif width[c] == 4 and slab32[s, row] == 0:
+                    slab32[s, row] = codes[v]
+
+def code_widths(color_cards):
+    """
+    Bytes per code (1, 2 or 4) for colors of the given cardinalities,
+    leaving code 0 for none.
+    """
+    color_cards = np.asarray(color_cards)
+    return np.where(color_cards < 2 ** 8, 1, np.where(color_cards < 2 ** 16, 2, 4)).astype(np.uint8)
+
+code_dtypes = {1: np.uint8, 2: np.uint16, 4: np.uint32}
+
+# Sparse colors (width 0) in two passes over the same row blocks:
+# hist[b, slot[c]] counts block b's rows with color c, and is then where
+# they go in rows and values, relative to sparse_indptr[slot[c]].
+# last[slot[c]] is 1 + the last row seen with color c, so only its
+# smallest column counts.
+@jit(
+    void(int32[:], int32[:], uint32[:], uint8[:], uint32[:],
+         uint32[:, ::1], int64),
+    nopython=True,
+    parallel=True
+)
+def _sparse_remap_count_compiled(
+    indptr, indices, color_map, width, slot, hist, block):
+    nrows = len(indptr) - 1
+    for b in prange(hist.shape[0]):
+        last = np.zeros(hist.shape[1], np.uint32)
+        for row in range(b * block, min(nrows, (b + 1) * block)):
+            for i in range(indptr[row], indptr[row + 1]):
+                c = color_map[indices[i]]
+                if width[c] == 0 and last[slot[c]] != row + 1:
+                    last[slot[c]] = row + 1
+                    hist[b, slot[c]] += 1
+
+@jit(
+    void(int32[:], int32[:], uint32[:], uint32[:], uint8[:], uint32[:],
+         uint32[:, ::1], uint64[:], int64, int32[:], uint32[:]),
+    nopython=True,
+    parallel=True
+)
+def _sparse_remap_fill_compiled(
+    indptr, indices, color_map, codes, width, slot, hist, sparse_indptr,
+    block, rows, values):
+    nrows = len(indptr) - 1
+    for b in prange(hist.shape[0]):
+        last = np.zeros(hist.shape[1], np.uint32)
+        for row in range(b * block, min(nrows, (b + 1) * block)):
+            for i in range(indptr[row], indptr[row + 1]):
+                v = indices[i]
+                c = color_map[v]
+                s = slot[c]
+                if width[c] == 0 and last[s] != row + 1:
+                    last[s] = row + 1
+                    dst = sparse_indptr[s] + hist[b, s]
+                    rows[dst] = row
+                    values[dst] = codes[v]
+                    hist[b, s] += 1
+
+class ColoredMatrix:
+    """
+    Column-major Xcategorical_color (see color_remap_columns): each
+    color's codes are stored in the narrowest of u8, u16, u32 that holds
+    color_cards[c], as one row of the slab for that width, so that
+    column(c) is a contiguous zero-copy view.
+
+    Colors present in fewer than sparse_density * nrows rows are instead
+    stored sparse, as sorted int32 rows and u32 codes in
+    sparse_rows/sparse_codes[sparse_indptr[slot[c]]:sparse_indptr[slot[c] + 1]]
+    (see sparse_column).
+
+    width[c] is the bytes per code of color c, or 0 if it's sparse.
+    """
+
+    def __init__(self, nrows, color_cards, width, slot, slabs,
+                 sparse_indptr, sparse_rows, sparse_codes):
+        self.nrows = nrows
+        self.ncolors = len(color_cards)
+        self.color_cards = color_cards
+        self.width = width
+        self.slot = slot
+        self.slabs = slabs
+        self.sparse_indptr = sparse_indptr
+        self.sparse_rows = sparse_rows
+        self.sparse_codes = sparse_codes
+
+    @classmethod
+    def from_coloring(cls, Xbinary_csr, ncolors, color_map,
+                      nnzc=None, sparse_density=0.0, block=4096):
+        """
+        Remaps Xbinary_csr by color, as in color_remap_columns (which
+        see for nnzc and block).
+        """
+        nrows, nverts = Xbinary_csr.shape
+        if nnzc is None:
+            nnzc = np.bincount(Xbinary_csr.indices, minlength=nverts)
+        codes = np.zeros(nverts, np.uint32)
+        color_cards = np.zeros(ncolors, np.uint32)
+        _member_codes_compiled(color_map, nnzc > 0, codes, color_cards)
+
+        width = code_widths(color_cards)
+        if sparse_density > 0:
+            # rows per color, exact unless there are conflicts
+            color_nnz = np.bincount(color_map, weights=nnzc, minlength=ncolors)
+            width[color_nnz < sparse_density * nrows] = 0
+        slot = np.zeros(ncolors, np.uint32)
+        slabs = {}
+        for w, dtype in code_dtypes.items():
+            colors = np.flatnonzero(width == w)
+            slot[colors] = np.arange(len(colors), dtype=np.uint32)
+            slabs[w] = np.zeros((len(colors), nrows), dtype)
+        sparse = np.flatnonzero(width == 0)
+        slot[sparse] = np.arange(len(sparse), dtype=np.uint32)
+
+        _stream_remap_compiled(
+            Xbinary_csr.indptr, Xbinary_csr.indices, color_map, codes, width, slot,
+            slabs[1], slabs[2], slabs[4], block)
+
+        nblocks = (nrows + block - 1) // block
+        hist = np.zeros((nblocks if len(sparse) else 0, len(sparse)), np.uint32)
+        sparse_indptr = np.zeros(len(sparse) + 1, np.uint64)
+        if len(sparse):
+            _sparse_remap_count_compiled(
+                Xbinary_csr.indptr, Xbinary_csr.indices, color_map, width, slot,
+                hist, block)
+            sparse_indptr = chunk_offsets(hist)
+        sparse_rows = np.empty(int(sparse_indptr[-1]), np.int32)
+        sparse_codes = np.empty(int(sparse_indptr[-1]), np.uint32)
+        if len(sparse):
+            _sparse_remap_fill_compiled(
+                Xbinary_csr.indptr, Xbinary_csr.indices, color_map, codes, width, slot,
+                hist, sparse_indptr, block, sparse_rows, sparse_codes)
+
+        return cls(nrows, color_cards, width, slot, slabs,
+                   sparse_indptr, sparse_rows, sparse_codes)
+
+    @property
+    def shape(self):
+        return (self.nrows, self.ncolors)
+
+    @property
+    def nbytes(self):
+        return sum(x.nbytes for x in [
+            *self.slabs.values(), self.sparse_indptr, self.sparse_rows, self.sparse_codes])
+
+    def is_sparse(self, c):
+        return self.width[c] == 0
+
+    def colors_of_width(self, w):
+        """
+        The colors stored at width w (0 for sparse), in slot order.
+        """
+        return np.flatnonzero(self.width == w).astype(np.uint32)
+
+    def column(self, c):
+        """
+        Color c's code in every row, as a zero-copy view, or a new
+        array of the narrowest width if c is stored sparse.
+        """
+        if not self.is_sparse(c):
+            return self.slabs[int(self.width[c])][self.slot[c]]
+        rows, codes = self.sparse_column(c)
+        w = int(code_widths(self.color_cards[c:c + 1])[0])
+        out = np.zeros(self.nrows, code_dtypes[w])
+        out[rows] = codes
+        return out
+
+    def sparse_column(self, c):
+        """
+        (rows, codes) views of the rows where sparse color c is present.
+        """
+        assert self.is_sparse(c), c
+        s = self.slot[c]
+        lo, hi = int(self.sparse_indptr[s]), int(self.sparse_indptr[s + 1])
+        return self.sparse_rows[lo:hi], self.sparse_codes[lo:hi]
+
+    def toarray(self):
+        """
+        The (nrows, ncolors) u32 matrix of color_remap.
+        """
+        out = np.zeros(self.shape, np.uint32)
+        for c in range(self.ncolors):
+            if self.is_sparse(c):
+                rows, codes = self.sparse_column(c)
+                out[rows, c] = codes
+            else:
+                out[:, c] = self.column(c)
+        return out
+
+    def tocsc(self):
+        """
+        The nonzero codes as a u32 CSC matrix. TargetEncoder takes the
+        ColoredMatrix itself, so this is only needed elsewhere.
+        """
+        indptr = np.zeros(self.ncolors + 1, np.int64)
+        indices, data = [], []
+        for c in range(self.ncolors):
+            if self.is_sparse(c):
+                rows, codes = self.sparse_column(c)
+            else:
+                col = self.column(c)
+                rows = np.flatnonzero(col).astype(np.int32)
+                codes = col[rows].astype(np.uint32)
+            indices.append(rows)
+            data.append(codes)
+            indptr[c + 1] = indptr[c] + len(rows)
+        return sps.csc_matrix(
+            (np.concatenate(data) if data else np.zeros(0, np.uint32),
+             np.concatenate(indices) if indices else np.zeros(0, np.int32),
+             indptr), shape=self.shape)
+
+def color_remap_columns(Xbinary_csr, ncolors, color_map, nnzc=None, block=4096):
+    """
+    color_remap without dense (nrows, ncolors) intermediates: member
+    codes come from one counting pass over color_map, restricted to the
+    columns with nonzeros (nnzc, by default counted from Xbinary_csr),
+    and the output is written in one parallel pass over blocks of rows,
+    with each color in the narrowest unsigned dtype that holds its codes.
+
+    The codes are those of color_remap, except that a column which
+    loses every one of its rows to a conflict still holds its code, and
+    that column 0 gets a code like any other (color_remap can't tell it
+    from none, which is fine for onehot's empty dummy column 0).
+
+    Returns (columns, color_cards), where columns[c] is color c's
+    codes for every row, a view into one (ncolors_of_width, nrows)
+    slab per width (see ColoredMatrix).
+    """
+    X = ColoredMatrix.from_coloring(Xbinary_csr, ncolors, color_map, nnzc, 0.0, block)
+    return [X.column(c) for c in range(ncolors)], X.color_cards
+
+# out[row, color_map[v]] = member_offsets[v] + code for the first (smallest)
+# column v of each color in the row, since every code is at least 1
+@jit(
+    void(int32[:], int32[:], uint32[:], uint32[:], uint32[:], uint32[:, ::1]),
+    nopython=True,
+    parallel=True
+)
+def _bundle_remap_compiled(indptr, indices, codes, color_map, member_offsets, out):
+    for row in prange(len(indptr) - 1):
+        for i in range(indptr[row], indptr[row + 1]):
+            v = indices[i]
+            c = color_map[v]
+            if out[row, c] == 0:
+                out[row, c] = member_offsets[v] + codes[i]
+
+def bundle_remap(Xcodes_csr, ncolors, color_map, vertex_nbins):
+    """
+    color_remap for columns with several codes each, as in LightGBM's
+    exclusive feature bundling: in each color, the members in column
+    order get consecutive ranges of vertex_nbins[v] codes, so member v's
+    code k (from 1) becomes member_offsets[v] + k and 0 stays none.
+    With Xcodes_csr and vertex_nbins from join_binned, sparse continuous
+    features bundle alongside the binary ones.
+
+    As in color_remap, the smallest column wins in conflicting rows.
+
+    Returns (Xcategorical_color, color_cards, member_offsets), where
+    color_cards[c] is the number of codes of color c.
+    """
+    nrows = Xcodes_csr.shape[0]
+    vertex_nbins = vertex_nbins.astype(np.uint64)
+    by_color = np.lexsort((np.arange(len(color_map)), color_map))
+    ends = np.cumsum(vertex_nbins[by_color])
+    color_cards = np.bincount(
+        color_map, weights=vertex_nbins, minlength=ncolors).astype(np.uint64)
+    color_starts = np.cumsum(color_cards) - color_cards
+    member_offsets = np.empty(len(color_map), np.uint64)
+    member_offsets[by_color] = ends - vertex_nbins[by_color] - color_starts[color_map[by_color]]
+    assert len(color_cards) == 0 or color_cards.max() < 2 ** 32, 'codes overflow u32'
+
+    Xcategorical_color = np.zeros((nrows, ncolors), np.uint32)
+    member_offsets = member_offsets.astype(np.uint32)
+    _bundle_remap_compiled(
+        Xcodes_csr.indptr, Xcodes_csr.indices, Xcodes_csr.data.astype(np.uint32, copy=False),
+        color_map, member_offsets, Xcategorical_color)
+    return Xcategorical_color, color_cards.astype(np.uint32), member_offsets
+
 import time
 from contextlib import contextmanager
 import sys
@@ -311,7 +2764,9 @@ def extract_continuous():
     return continuous_feature_ixs
 
 @memory.cache
-def extract_sparse():
+def extract_sparse(continuous_format='dense'):
+    # continuous_format='csc' keeps the mostly-zero continuous columns
+    # sparse, for bin_continuous and bundle_remap
     with timeit('load all svmlight files'):
         Xs, ys, nrows, ncols = read_all_svmlight()
 
@@ -323,7 +2778,10 @@ def extract_sparse():
         cat_feature_ixs = [i for i in range(Xs[0].shape[1]) if i not in set(continuous_feature_ixs)]
 
     with timeit('extract continuous'):
-        Xcontinuous = np.concatenate([X[:, continuous_feature_ixs].todense() for X in Xs])
+        if continuous_format == 'csc':
+            Xcontinuous = sps.vstack([X[:, continuous_feature_ixs] for X in Xs], 'csc')
+        else:
+            Xcontinuous = np.concatenate([X[:, continuous_feature_ixs].todense() for X in Xs])
 
     with timeit('extract categorical'):
         # TODO: csc-specialized version of this should be really fast
@@ -332,8 +2790,8 @@ def extract_sparse():
     return Xcontinuous, Xcategorical_csc, ys, nrows, ncols
 
 @memory.cache
-def get_all_data():
-    Xcontinuous, Xcategorical_csc, ys, nrows, ncols = extract_sparse()
+def get_all_data(continuous_format='dense'):
+    Xcontinuous, Xcategorical_csc, ys, nrows, ncols = extract_sparse(continuous_format)
 
     with timeit('cat label'):
         y = np.concatenate(ys) == 1
@@ -473,6 +2931,342 @@ def transform_target_encode_dense(
             value_ix = offsets[col] + Xcat[row, col] - 1
             data_out[row, col] = means[value_ix]
 
+# Parallel versions of the above. The means of each column live in
+# offsets[col]:offsets[col + 1], so anything split by column writes
+# disjoint ranges and sums in the same order as the serial loops.
+
+@jit(void(uint32[:], float64[:], uint32[:]), nopython=True, parallel=True)
+def sums_to_means_parallel(offsets, means, counts):
+    for col in prange(len(offsets) - 1):
+        start, stop = offsets[col], offsets[col + 1]
+        net_sum = means[start:stop].sum()
+        net_count = counts[start:stop].sum()
+        for i in range(start, stop):
+            if counts[i]:
+                means[i] = means[i] / counts[i]
+            else:
+                means[i] = net_sum / net_count if net_count else 0
+
+@jit(void(int32[:], uint32[:], int32[:], float64[:],
+          uint32[:], uint32[:], float64[:]),
+     nopython=True,
+     parallel=True)
+def fit_target_encode_csc_parallel(
+    indptr, data, indices, y,
+    offsets, counts, means):
+    for col in prange(len(indptr) - 1):
+        for nnz_ix in range(indptr[col], indptr[col + 1]):
+            value_ix = offsets[col] + data[nnz_ix] - 1
+            means[value_ix] += y[indices[nnz_ix]]
+            counts[value_ix] += 1
+
+    sums_to_means_parallel(offsets, means, counts)
+
+@jit([void(int32[:], uint32[:], uint32[:], float64[:], float64[:]),
+      void(int32[:], uint32[:], uint32[:], float64[:], float32[:])],
+     nopython=True,
+     parallel=True)
+def transform_target_encode_csc_parallel(
+    indptr, data,
+    offsets, means,
+    data_out):
+    for col in prange(len(indptr) - 1):
+        for nnz_ix in range(indptr[col], indptr[col + 1]):
+            data_out[nnz_ix] = means[offsets[col] + data[nnz_ix] - 1]
+
+# Dense fit over tasks of one chunk of rows by one block of col_block
+# columns, each row-major run of a block staying in cache. Chunk t sums
+# into its own sums[t] and counts[t], which are then added up in chunk
+# order, so the result depends on the number of chunks but not on the
+# thread count.
+@jit(void(uint32[:, ::1], float64[:], uint32[:],
+          float64[:, ::1], uint32[:, ::1], int64),
+     nopython=True,
+     parallel=True)
+def _fit_target_encode_dense_partials(Xcat, y, offsets, sums, counts, col_block):
+    nrows, ncols = Xcat.shape
+    nchunks = sums.shape[0]
+    nblocks = (ncols + col_block - 1) // col_block
+    for task in prange(nchunks * nblocks):
+        t, b = task // nblocks, task % nblocks
+        for row in range(t * nrows // nchunks, (t + 1) * nrows // nchunks):
+            for col in range(b * col_block, min(ncols, (b + 1) * col_block)):
+                value_ix = offsets[col] + Xcat[row, col] - 1
+                sums[t, value_ix] += y[row]
+                counts[t, value_ix] += 1
+
+@jit(void(float64[:, ::1], uint32[:, ::1], uint32[:], float64[:]),
+     nopython=True,
+     parallel=True)
+def _reduce_target_partials(sums, counts, counts_out, means):
+    n = len(means)
+    nblocks = min(n, 1024)
+    for b in prange(nblocks):
+        lo, hi = b * n // nblocks, (b + 1) * n // nblocks
+        for t in range(sums.shape[0]):
+            means[lo:hi] += sums[t, lo:hi]
+            counts_out[lo:hi] += counts[t, lo:hi]
+
+def fit_target_encode_dense_parallel(
+    Xcat, y,
+    offsets, counts, means,
+    nchunks=None, col_block=64):
+    """
+    fit_target_encode_dense over nchunks chunks of rows (16 by default,
+    fewer if the partial sums would pass 256MB) and blocks of col_block
+    columns in parallel.
+    """
+    if nchunks is None:
+        nchunks = max(1, min(16, 2 ** 28 // max(1, 12 * len(means))))
+    Xcat = np.ascontiguousarray(Xcat, dtype=np.uint32)
+    sums = np.zeros((nchunks, len(means)), np.float64)
+    partial_counts = np.zeros((nchunks, len(means)), np.uint32)
+    _fit_target_encode_dense_partials(Xcat, y, offsets, sums, partial_counts, col_block)
+    _reduce_target_partials(sums, partial_counts, counts, means)
+    sums_to_means_parallel(offsets, means, counts)
+
+@jit(void(uint32[:, ::1], uint32[::1], float64[::1], float64[:, ::1], int64),
+     nopython=True,
+     parallel=True)
+def _transform_target_encode_dense_f64(Xcat, offsets, means, data_out, block):
+    nrows, ncols = Xcat.shape
+    x, out = Xcat.reshape(-1), data_out.reshape(-1)
+    for b in prange((nrows + block - 1) // block):
+        lo = b * block
+        C_target_encode_rows_f64(
+            ffi_native.from_buffer(x), lo * ncols, ffi_native.from_buffer(offsets),
+            ffi_native.from_buffer(means), ffi_native.from_buffer(out), lo * ncols,
+            min(nrows, lo + block) - lo, ncols)
+
+@jit(void(uint32[:, ::1], uint32[::1], float64[::1], float32[:, ::1], int64),
+     nopython=True,
+     parallel=True)
+def _transform_target_encode_dense_f32(Xcat, offsets, means, data_out, block):
+    nrows, ncols = Xcat.shape
+    x, out = Xcat.reshape(-1), data_out.reshape(-1)
+    for b in prange((nrows + block - 1) // block):
+        lo = b * block
+        C_target_encode_rows_f32(
+            ffi_native.from_buffer(x), lo * ncols, ffi_native.from_buffer(offsets),
+            ffi_native.from_buffer(means), ffi_native.from_buffer(out), lo * ncols,
+            min(nrows, lo + block) - lo, ncols)
+
+def transform_target_encode_dense_parallel(
+    Xcat,
+    offsets, means,
+    data_out, block=1024):
+    """
+    transform_target_encode_dense over blocks of rows in parallel, with
+    the vectorized gathers and streaming stores of coloring_native.c
+    into a C-contiguous float64 or float32 data_out.
+    """
+    assert len(means) < 2 ** 31, 'gathers take int32 slots'
+    Xcat = np.ascontiguousarray(Xcat, dtype=np.uint32)
+    if data_out.dtype == np.float32:
+        _transform_target_encode_dense_f32(Xcat, offsets, means, data_out, block)
+    else:
+        _transform_target_encode_dense_f64(Xcat, offsets, means, data_out, block)
+
+# Target encoding straight from a ColoredMatrix, one color per task. The
+# colors stored at width w are the rows of slabs[w] in color order, with
+# colors[s] the color of row s, and likewise for the sparse colors and
+# sparse_indptr. Each color owns means[offsets[c]:offsets[c + 1]], so the
+# sums come out as in the serial loops. Code 0 (no member) is skipped,
+# like an implicit zero of csc.
+@jit([void(uint8[:, ::1], uint32[:], float64[:], uint32[:], uint32[:], float64[:]),
+      void(uint16[:, ::1], uint32[:], float64[:], uint32[:], uint32[:], float64[:]),
+      void(uint32[:, ::1], uint32[:], float64[:], uint32[:], uint32[:], float64[:])],
+     nopython=True,
+     parallel=True)
+def _fit_target_encode_slab(slab, colors, y, offsets, counts, means):
+    for s in prange(slab.shape[0]):
+        base = int64(offsets[colors[s]]) - 1
+        for row in range(slab.shape[1]):
+            code = slab[s, row]
+            if code:
+                means[base + code] += y[row]
+                counts[base + code] += 1
+
+@jit(void(uint64[:], int32[:], uint32[:], uint32[:], float64[:],
+          uint32[:], uint32[:], float64[:]),
+     nopython=True,
+     parallel=True)
+def _fit_target_encode_sparse_colors(
+    sparse_indptr, sparse_rows, sparse_codes, colors, y,
+    offsets, counts, means):
+    for s in prange(len(colors)):
+        base = int64(offsets[colors[s]]) - 1
+        for i in range(sparse_indptr[s], sparse_indptr[s + 1]):
+            means[base + sparse_codes[i]] += y[sparse_rows[i]]
+            counts[base + sparse_codes[i]] += 1
+
+# out[c, row] is the encoding of color c in row, left as is for code 0
+@jit([void(uint8[:, ::1], uint32[:], uint32[:], float64[:], float64[:, ::1]),
+      void(uint16[:, ::1], uint32[:], uint32[:], float64[:], float64[:, ::1]),
+      void(uint32[:, ::1], uint32[:], uint32[:], float64[:], float64[:, ::1]),
+      void(uint8[:, ::1], uint32[:], uint32[:], float64[:], float32[:, ::1]),
+      void(uint16[:, ::1], uint32[:], uint32[:], float64[:], float32[:, ::1]),
+      void(uint32[:, ::1], uint32[:], uint32[:], float64[:], float32[:, ::1])],
+     nopython=True,
+     parallel=True)
+def _transform_target_encode_slab(slab, colors, offsets, means, out):
+    for s in prange(slab.shape[0]):
+        c = colors[s]
+        base = int64(offsets[c]) - 1
+        for row in range(slab.shape[1]):
+            code = slab[s, row]
+            if code:
+                out[c, row] = means[base + code]
+
+@jit([void(uint64[:], int32[:], uint32[:], uint32[:],
+           uint32[:], float64[:], float64[:, ::1]),
+      void(uint64[:], int32[:], uint32[:], uint32[:],
+           uint32[:], float64[:], float32[:, ::1])],
+     nopython=True,
+     parallel=True)
+def _transform_target_encode_sparse_colors(
+    sparse_indptr, sparse_rows, sparse_codes, colors,
+    offsets, means, out):
+    for s in prange(len(colors)):
+        c = colors[s]
+        base = int64(offsets[c]) - 1
+        for i in range(sparse_indptr[s], sparse_indptr[s + 1]):
+            out[c, sparse_rows[i]] = means[base + sparse_codes[i]]
+
+# csc output: nnz[c] counts color c's rows with a member, then each
+# color's rows and encodings go to indices/data[indptr[c]:indptr[c + 1]]
+@jit([void(uint8[:, ::1], uint32[:], uint32[:]),
+      void(uint16[:, ::1], uint32[:], uint32[:]),
+      void(uint32[:, ::1], uint32[:], uint32[:])],
+     nopython=True,
+     parallel=True)
+def _slab_nnz(slab, colors, nnz):
+    for s in prange(slab.shape[0]):
+        n = uint32(0)
+        for row in range(slab.shape[1]):
+            if slab[s, row]:
+                n += 1
+        nnz[colors[s]] = n
+
+@jit([void(uint8[:, ::1], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float64[:]),
+      void(uint16[:, ::1], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float64[:]),
+      void(uint32[:, ::1], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float64[:]),
+      void(uint8[:, ::1], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float32[:]),
+      void(uint16[:, ::1], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float32[:]),
+      void(uint32[:, ::1], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float32[:])],
+     nopython=True,
+     parallel=True)
+def _transform_target_encode_slab_csc(
+    slab, colors, offsets, means, indptr, indices, data):
+    for s in prange(slab.shape[0]):
+        c = colors[s]
+        base = int64(offsets[c]) - 1
+        i = int64(indptr[c])
+        for row in range(slab.shape[1]):
+            code = slab[s, row]
+            if code:
+                indices[i] = row
+                data[i] = means[base + code]
+                i += 1
+
+@jit([void(uint64[:], int32[:], uint32[:], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float64[:]),
+      void(uint64[:], int32[:], uint32[:], uint32[:], uint32[:], float64[:],
+           uint64[:], int32[:], float32[:])],
+     nopython=True,
+     parallel=True)
+def _transform_target_encode_sparse_colors_csc(
+    sparse_indptr, sparse_rows, sparse_codes, colors, offsets, means,
+    indptr, indices, data):
+    for s in prange(len(colors)):
+        c = colors[s]
+        base = int64(offsets[c]) - 1
+        i = int64(indptr[c])
+        for j in range(sparse_indptr[s], sparse_indptr[s + 1]):
+            indices[i] = sparse_rows[j]
+            data[i] = means[base + sparse_codes[j]]
+            i += 1
+
+def fit_target_encode_colored_precondition(
+    Xcat, y,
+    offsets, counts, means):
+    sums_to_means_precondition(offsets, means, counts)
+    assert Xcat.ncolors + 1 == len(offsets)
+    assert Xcat.nrows == len(y)
+    assert np.all(Xcat.color_cards <= np.diff(offsets))
+
+def fit_target_encode_colored(
+    Xcat, y,
+    offsets, counts, means):
+    """
+    fit_target_encode_csc over a ColoredMatrix, reading each color's
+    codes where they're stored, in parallel over colors.
+    """
+    for w, slab in Xcat.slabs.items():
+        if len(slab):
+            _fit_target_encode_slab(
+                slab, Xcat.colors_of_width(w), y, offsets, counts, means)
+    sparse = Xcat.colors_of_width(0)
+    if len(sparse):
+        _fit_target_encode_sparse_colors(
+            Xcat.sparse_indptr, Xcat.sparse_rows, Xcat.sparse_codes, sparse, y,
+            offsets, counts, means)
+    sums_to_means_parallel(offsets, means, counts)
+
+def transform_target_encode_colored(
+    Xcat,
+    offsets, means,
+    data_out):
+    """
+    Writes the encodings of the ColoredMatrix Xcat into the C-contiguous
+    (ncolors, nrows) data_out, e.g. the transpose of a Fortran-ordered
+    output, leaving it as is where a color has no member.
+    """
+    for w, slab in Xcat.slabs.items():
+        if len(slab):
+            _transform_target_encode_slab(
+                slab, Xcat.colors_of_width(w), offsets, means, data_out)
+    sparse = Xcat.colors_of_width(0)
+    if len(sparse):
+        _transform_target_encode_sparse_colors(
+            Xcat.sparse_indptr, Xcat.sparse_rows, Xcat.sparse_codes, sparse,
+            offsets, means, data_out)
+
+def transform_target_encode_colored_csc(
+    Xcat,
+    offsets, means,
+    dtype=np.float64):
+    """
+    The encodings of the ColoredMatrix Xcat as a csc matrix of dtype,
+    with the rows where a color has no member left out.
+    """
+    sparse = Xcat.colors_of_width(0)
+    nnz = np.zeros(Xcat.ncolors, np.uint32)
+    for w, slab in Xcat.slabs.items():
+        if len(slab):
+            _slab_nnz(slab, Xcat.colors_of_width(w), nnz)
+    nnz[sparse] = np.diff(Xcat.sparse_indptr)
+    indptr = np.empty(Xcat.ncolors + 1, np.uint64)
+    parallel_cumsum(nnz, indptr)
+    indices = np.empty(int(indptr[-1]), np.int32)
+    data = np.empty(int(indptr[-1]), dtype)
+    for w, slab in Xcat.slabs.items():
+        if len(slab):
+            _transform_target_encode_slab_csc(
+                slab, Xcat.colors_of_width(w), offsets, means,
+                indptr, indices, data)
+    if len(sparse):
+        _transform_target_encode_sparse_colors_csc(
+            Xcat.sparse_indptr, Xcat.sparse_rows, Xcat.sparse_codes, sparse,
+            offsets, means, indptr, indices, data)
+    return sps.csc_matrix((data, indices, indptr.astype(np.int64)), shape=Xcat.shape)
+
 class TargetEncoder:
     """
     Should be initialized with
@@ -480,16 +3274,24 @@ class TargetEncoder:
     cards - cardinalities for categorical columns, in order,
             excluding zeros from cardinality
     is_sparse - whether to expect sparse categorical inputs or dense ones
+                (a ColoredMatrix is taken either way, and is_sparse then
+                picks the output)
+    parallel - whether to use the parallel fits and transforms
+    dtype - float64 or float32 output of transform, continuous columns
+            included (float32 needs parallel)
 
     It's OK to know this cardinality info ahead of time since
     values unseen in training are filled with the average
     target value from the training set.
     """
 
-    def __init__(self, *, cards, is_sparse, debug):
+    def __init__(self, *, cards, is_sparse, debug, parallel=False, dtype=np.float64):
         self.cards = cards.astype(np.uint32)
         self.is_sparse = is_sparse
         self.debug = debug
+        self.parallel = parallel
+        self.dtype = np.dtype(dtype)
+        assert parallel or self.dtype == np.float64, self.dtype
 
         # means with imputation values for non-zero entries
         self.means = np.zeros(np.sum(cards), np.float64)
@@ -497,6 +3299,8 @@ class TargetEncoder:
         self.offsets = np.cumsum(np.insert(cards, 0, 0), dtype=np.uint32)
 
     def check_sparse(self, Xcat):
+        if isinstance(Xcat, ColoredMatrix):
+            return
         assert self.is_sparse == sps.issparse(Xcat), (self.is_sparse, type(Xcat))
         if self.is_sparse:
             assert Xcat.getformat() == 'csc', Xcat.getformat()
@@ -513,24 +3317,42 @@ class TargetEncoder:
         the transformation of this operator will (by necessity of
         classifier interfaces) generate a sparse matrix with the
         categorical values.
+
+        Xcat may also be a ColoredMatrix, which is read color by color
+        where it's stored (always in parallel) without materializing
+        it. Its zero codes (no member) are skipped like the implicit
+        zeros of csc, and transform encodes them as 0.
         """
         Xcont, Xcat = X
         self.check_sparse( Xcat)
 
-        if self.is_sparse:
+        if isinstance(Xcat, ColoredMatrix):
+            args = (
+                Xcat, y,
+                self.offsets, self.counts, self.means)
+            if self.debug:
+                fit_target_encode_colored_precondition(*args)
+            fit_target_encode_colored(*args)
+        elif self.is_sparse:
             args = (
                 Xcat.indptr, Xcat.data, Xcat.indices, y,
                 self.offsets, self.counts, self.means)
             if self.debug:
                 fit_target_encode_csc_precondition(*args)
-            fit_target_encode_csc(*args)
+            if self.parallel:
+                fit_target_encode_csc_parallel(*args)
+            else:
+                fit_target_encode_csc(*args)
         else:
             args = (
                 Xcat, y,
                 self.offsets, self.counts, self.means)
             if self.debug:
                 fit_target_encode_dense_precondition(*args)
-            fit_target_encode_dense(*args)
+            if self.parallel:
+                fit_target_encode_dense_parallel(*args)
+            else:
+                fit_target_encode_dense(*args)
 
         return self
 
@@ -542,27 +3364,44 @@ class TargetEncoder:
 
         Returns a single matrix, the new design matrix
         after categorical encoding, which will be sparse
-        iff self.is_sparse
+        iff self.is_sparse. The whole matrix is in self.dtype, so with
+        float32 the continuous columns are narrowed too.
         """
         Xcont, Xcat = X
         self.check_sparse(Xcat)
 
-        if self.is_sparse:
-            data_out = np.empty(Xcat.data.shape, np.float64)
-            transform_target_encode_csc(
+        if isinstance(Xcat, ColoredMatrix):
+            if self.is_sparse:
+                Xcat_encoded = transform_target_encode_colored_csc(
+                    Xcat, self.offsets, self.means, self.dtype)
+                return sps.hstack([Xcont, Xcat_encoded], 'csc', dtype=self.dtype)
+            # Fortran order, so that each color's output is contiguous
+            ncont = Xcont.shape[1]
+            out = np.zeros((Xcat.nrows, ncont + Xcat.ncolors), self.dtype, order='F')
+            out[:, :ncont] = Xcont
+            transform_target_encode_colored(
+                Xcat, self.offsets, self.means, out.T[ncont:])
+            return out
+        elif self.is_sparse:
+            data_out = np.empty(Xcat.data.shape, self.dtype)
+            transform = (transform_target_encode_csc_parallel
+                         if self.parallel else transform_target_encode_csc)
+            transform(
                     Xcat.indptr, Xcat.data,
                     self.offsets, self.means,
                     data_out)
             Xcat_encoded = sps.csc_matrix((data_out, Xcat.indices, Xcat.indptr))
-            return sps.hstack([Xcont, Xcat_encoded], 'csc')
+            return sps.hstack([Xcont, Xcat_encoded], 'csc', dtype=self.dtype)
         else:
-            data_out = np.zeros(Xcat.shape, np.float64)
-            transform_target_encode_dense(
+            data_out = np.zeros(Xcat.shape, self.dtype)
+            transform = (transform_target_encode_dense_parallel
+                         if self.parallel else transform_target_encode_dense)
+            transform(
                     Xcat,
                     self.offsets, self.means,
                     data_out
                 )
-            return np.hstack([Xcont, Xcat])
+            return np.hstack([Xcont.astype(self.dtype, copy=False), data_out])
 
     def fit_transform(self, X, y=None):
         return self.fit(X, y).transform(X, y)